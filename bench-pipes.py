@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+
+# Measure throughput of a pipeline depending on capacity of its pipes.
+# Usage: bench-pipes.py [megabytes to push through the pipeline]
+
+import subprocess
+import sys
+import time
+
+SIZES = ['', '128K', '256K', '512K', '1M']
+PIPELINE = 'PIPESIZE={size} head -c {nbytes} /dev/zero | cat | cat | wc -c'
+REPEAT = 3
+
+
+def run(size, nbytes):
+    cmd = PIPELINE.format(size=size, nbytes=nbytes)
+    best = None
+    for _ in range(REPEAT):
+        start = time.perf_counter()
+        out = subprocess.run(['./shell', '-c', cmd], check=True,
+                             stdout=subprocess.PIPE, text=True).stdout
+        elapsed = time.perf_counter() - start
+        assert int(out) == nbytes
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+if __name__ == '__main__':
+    megabytes = int(sys.argv[1]) if len(sys.argv) > 1 else 1024
+    nbytes = megabytes << 20
+    print('%-10s %10s %10s' % ('PIPESIZE', 'time [s]', 'MiB/s'))
+    for size in SIZES:
+        elapsed = run(size, nbytes)
+        print('%-10s %10.3f %10.1f' %
+              (size or 'default', elapsed, megabytes / elapsed))
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+
+# Count system calls the shell makes to spawn a simple command and pipelines.
+# Counts are split between the shell and its children before they execute
+# a program. Each command is measured both in a script and in an interactive
+# shell running on a pseudo-terminal, where job control is enabled.
+# Usage: bench-spawn.py [-v] [--check]
+
+import fcntl
+import os
+import pty
+import re
+import subprocess
+import sys
+import tempfile
+import termios
+from collections import Counter
+
+CASES = [
+    ('simple command', '/bin/true'),
+    ('2-stage pipeline', '/bin/true | /bin/true'),
+    ('4-stage pipeline', '/bin/true | /bin/true | /bin/true | /bin/true'),
+    ('background job', '/bin/true &'),
+    ('builtin stage', 'echo | /bin/true'),
+]
+
+# Upper bounds of shell and child system calls per command for --check.
+# Counts of the shell depend on how many SIGCHLD signals it takes to reap
+# a job, and `Fork` of libcsapp randomly sleeps in children. Background jobs
+# are reaped at random moments, so the shell's cost is not checked. Threads
+# running builtins are accounted to the shell and with AddressSanitizer they
+# cost more system calls than a fork, but no copy of the address space. Under
+# job control builtin stages are forked like other commands.
+BUDGET = {
+    ('script', 'simple command'): (11, 7),
+    ('script', '2-stage pipeline'): (20, 17),
+    ('script', '4-stage pipeline'): (36, 34),
+    ('script', 'background job'): (None, 8),
+    ('script', 'builtin stage'): (46, 9),
+    ('interactive', 'simple command'): (18, 13),
+    ('interactive', '2-stage pipeline'): (27, 29),
+    ('interactive', '4-stage pipeline'): (47, 58),
+    ('interactive', 'background job'): (None, 12),
+    ('interactive', 'builtin stage'): (28, 31),
+}
+
+# Both scripts have the same length, so the costs of reading and parsing
+# them cancel out, leaving the cost of (HI - LO) commands.
+LO, HI = 10, 30
+UNISTD = '/usr/include/x86_64-linux-gnu/asm/unistd_64.h'
+ENV = dict(os.environ, ASAN_OPTIONS='detect_leaks=0')
+
+
+def syscall_names():
+    names = {}
+    try:
+        with open(UNISTD) as f:
+            for line in f:
+                m = re.match(r'#define __NR_(\w+)\s+(\d+)', line)
+                if m:
+                    names[int(m.group(2))] = m.group(1)
+    except OSError:
+        pass
+    return names
+
+
+def controlling_tty():
+    os.setsid()
+    fcntl.ioctl(0, termios.TIOCSCTTY, 0)
+
+
+def run_interactive(cmd, lines):
+    master, slave = pty.openpty()
+    proc = subprocess.Popen(cmd + ['./shell'], env=ENV, stdin=slave,
+                            stdout=slave, stderr=slave,
+                            preexec_fn=controlling_tty)
+    os.close(slave)
+    # Readline flushes pending input, so each line waits for a prompt.
+    for line in lines + ['exit']:
+        output = b''
+        while not output.endswith(b'# '):
+            output += os.read(master, 4096)
+        os.write(master, line.encode() + b'\n')
+    try:
+        while os.read(master, 4096):
+            pass
+    except OSError:  # EIO once the slave side is closed
+        pass
+    os.close(master)
+    proc.wait()
+
+
+def syscount(lines, interactive):
+    with tempfile.NamedTemporaryFile('r') as out:
+        cmd = ['./syscount', '-o', out.name]
+        if interactive:
+            run_interactive(cmd, lines)
+        else:
+            subprocess.run(cmd + ['./shell', '-c', '\n'.join(lines)], env=ENV,
+                           stdout=subprocess.DEVNULL, check=True)
+        counts = {'shell': Counter(), 'child': Counter()}
+        for line in out:
+            role, nr, count = line.split()
+            counts[role][int(nr)] += int(count)
+        return counts
+
+
+def measure(cmd, interactive):
+    nop = ':'.ljust(len(cmd))
+    lo = syscount([cmd] * LO + [nop] * (HI - LO), interactive)
+    hi = syscount([cmd] * HI, interactive)
+    result = {}
+    for role in lo:
+        diff = Counter(hi[role])
+        diff.subtract(lo[role])
+        result[role] = {nr: c / (HI - LO) for nr, c in diff.items() if c > 0}
+    return result
+
+
+if __name__ == '__main__':
+    verbose = '-v' in sys.argv
+    check = '--check' in sys.argv
+    names = syscall_names()
+    failed = False
+    print('%-12s %-20s %8s %8s' % ('mode', 'command', 'shell', 'child'))
+    for mode in ('script', 'interactive'):
+        for name, cmd in CASES:
+            result = measure(cmd, mode == 'interactive')
+            shell = sum(result['shell'].values())
+            child = sum(result['child'].values())
+            print('%-12s %-20s %8.1f %8.1f' % (mode, name, shell, child))
+            if verbose:
+                for role in ('shell', 'child'):
+                    for nr, c in sorted(result[role].items()):
+                        print('  %-6s %-20s %6.1f' %
+                              (role, names.get(nr, str(nr)), c))
+            budget = BUDGET[mode, name]
+            if check and (shell > (budget[0] or shell) or child > budget[1]):
+                print('  over budget of %s/%s' % budget)
+                failed = True
+    sys.exit(1 if failed else 0)
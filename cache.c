@@ -0,0 +1,70 @@
+#include "shell.h"
+#include "queue.h"
+
+/* Parsed command lines are kept in LRU cache, so that a line repeated from
+ * history skips tokenization, redirection parsing and PATH search. */
+
+#define CACHE_SIZE 64     /* maximum number of cached command lines */
+#define CACHE_BUCKETS 128 /* must be a power of two */
+
+typedef struct centry {
+  LIST_ENTRY(centry) hash_link; /* entries with the same bucket */
+  TAILQ_ENTRY(centry) lru_link; /* most recently used entries first */
+  uint32_t hash;                /* hash of command line text */
+  char *text;                   /* original command line */
+  cmd_t *cmd;                   /* parsed command line */
+} centry_t;
+
+static LIST_HEAD(, centry) buckets[CACHE_BUCKETS];
+static TAILQ_HEAD(lruhead, centry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static int ncached = 0;
+
+static void evict(void) {
+  centry_t *e = TAILQ_LAST(&lru, lruhead);
+  debug("[cache] evict '%s'\n", e->text);
+  TAILQ_REMOVE(&lru, e, lru_link);
+  LIST_REMOVE(e, hash_link);
+  freecmd(e->cmd);
+  free(e->text);
+  free(e);
+  ncached--;
+}
+
+/* Returns parsed command text from the cache or parses it and caches it.
+ * Returned command stays valid until next call to `getcmd`. */
+cmd_t *getcmd(const char *line, int *statusp) {
+  uint32_t hash = jenkins_hash(line, strlen(line), HASHINIT);
+  centry_t *e;
+
+  LIST_FOREACH(e, &buckets[hash & (CACHE_BUCKETS - 1)], hash_link) {
+    if (e->hash != hash || strcmp(e->text, line))
+      continue;
+    TAILQ_REMOVE(&lru, e, lru_link);
+    TAILQ_INSERT_HEAD(&lru, e, lru_link);
+    *statusp = P_OK;
+    return e->cmd;
+  }
+
+  cmd_t *cmd = parse(line, statusp);
+  if (cmd == NULL)
+    return NULL;
+
+  if (ncached == CACHE_SIZE)
+    evict();
+
+  e = malloc(sizeof(centry_t));
+  e->hash = hash;
+  e->text = strdup(line);
+  e->cmd = cmd;
+  LIST_INSERT_HEAD(&buckets[hash & (CACHE_BUCKETS - 1)], e, hash_link);
+  TAILQ_INSERT_HEAD(&lru, e, lru_link);
+  ncached++;
+  return cmd;
+}
+
+/* Drop all cached commands, e.g. when alias definitions have changed,
+ * since aliases are expanded when a command is parsed. */
+void flushcache(void) {
+  while (ncached > 0)
+    evict();
+}
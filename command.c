@@ -1,29 +1,83 @@
 #include "shell.h"
+#include <stdarg.h>
 
-typedef int (*func_t)(char **argv);
+#include "queue.h"
+#include "rio.h"
 
 typedef struct {
   const char *name;
-  func_t func;
+  builtin_t func;
+  int flags;
 } command_t;
 
-static int do_quit(char **argv) {
+/* Functions and aliases are kept in hash tables indexed with the same hash
+ * value as the table of builtins, so a command name is hashed only once. */
+#define NBUCKETS 64 /* must be a power of two */
+
+/* Diagnostics of a builtin go to its standard error, which may be redirected
+ * without touching the shell's own, e.g. `cd /nonexistent 2>/dev/null`. */
+#define bmsg(io, ...) dprintf((io)->err, __VA_ARGS__)
+
+static uint32_t namehash(const char *name);
+
+static int do_quit(char **argv, io_t *io) {
   shutdownjobs();
   exit(EXIT_SUCCESS);
 }
 
+/*
+ * Leave the shell.
+ * 'exit' - with exit code of last command
+ * 'exit n' - with exit code n
+ */
+static int do_exit(char **argv, io_t *io) {
+  int code = argv[0] ? atoi(argv[0]) : exitstatus;
+  shutdownjobs();
+  exit(code & 255);
+}
+
+/* Common part of `break` and `continue`: leave n enclosing loops. */
+static int skiploops(char **argv, io_t *io, const char *name, int skip) {
+  int n = argv[0] ? atoi(argv[0]) : 1;
+  if (n < 1) {
+    bmsg(io, "%s: %s: loop count out of range\n", name, argv[0]);
+    return 1;
+  }
+  if (loopnest == 0)
+    return 0;
+  evalskip = skip;
+  skipcount = min(n, loopnest);
+  return 0;
+}
+
+/*
+ * Exit from enclosing loop.
+ * 'break n' - exit from n enclosing loops
+ */
+static int do_break(char **argv, io_t *io) {
+  return skiploops(argv, io, "break", SKIP_BREAK);
+}
+
+/*
+ * Resume next iteration of enclosing loop.
+ * 'continue n' - resume n-th enclosing loop
+ */
+static int do_continue(char **argv, io_t *io) {
+  return skiploops(argv, io, "continue", SKIP_CONT);
+}
+
 /*
  * Change current working directory.
  * 'cd' - change to $HOME
  * 'cd path' - change to provided path
  */
-static int do_chdir(char **argv) {
-  char *path = argv[0];
+static int do_chdir(char **argv, io_t *io) {
+  const char *path = argv[0];
   if (path == NULL)
-    path = getenv("HOME");
+    path = getvar("HOME");
   int rc = chdir(path);
   if (rc < 0) {
-    msg("cd: %s: %s\n", strerror(errno), path);
+    bmsg(io, "cd: %s: %s\n", strerror(errno), path);
     return 1;
   }
   return 0;
@@ -32,7 +86,7 @@ static int do_chdir(char **argv) {
 /*
  * Displays all stopped or running jobs.
  */
-static int do_jobs(char **argv) {
+static int do_jobs(char **argv, io_t *io) {
   watchjobs(ALL);
   return 0;
 }
@@ -42,13 +96,13 @@ static int do_jobs(char **argv) {
  * 'fg' choose highest numbered job
  * 'fg n' choose job number n
  */
-static int do_fg(char **argv) {
+static int do_fg(char **argv, io_t *io) {
   int j = argv[0] ? atoi(argv[0]) : -1;
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
   if (!resumejob(j, FG, &mask))
-    msg("fg: job not found: %s\n", argv[0]);
+    bmsg(io, "fg: job not found: %s\n", argv[0]);
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
@@ -58,13 +112,13 @@ static int do_fg(char **argv) {
  * 'bg' choose highest numbered job
  * 'bg n' choose job number n
  */
-static int do_bg(char **argv) {
+static int do_bg(char **argv, io_t *io) {
   int j = argv[0] ? atoi(argv[0]) : -1;
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
   if (!resumejob(j, BG, &mask))
-    msg("bg: job not found: %s\n", argv[0]);
+    bmsg(io, "bg: job not found: %s\n", argv[0]);
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
@@ -74,7 +128,7 @@ static int do_bg(char **argv) {
  * 'bg' choose highest numbered job
  * 'bg n' choose job number n
  */
-static int do_kill(char **argv) {
+static int do_kill(char **argv, io_t *io) {
   if (!argv[0])
     return -1;
   if (*argv[0] != '%')
@@ -85,30 +139,1402 @@ static int do_kill(char **argv) {
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
   if (!killjob(j))
-    msg("kill: job not found: %s\n", argv[0]);
+    bmsg(io, "kill: job not found: %s\n", argv[0]);
   Sigprocmask(SIG_SETMASK, &mask, NULL);
 
   return 0;
 }
 
-static command_t builtins[] = {
-  {"quit", do_quit}, {"cd", do_chdir},  {"jobs", do_jobs}, {"fg", do_fg},
-  {"bg", do_bg},     {"kill", do_kill}, {NULL, NULL},
-};
+/* Builtins gather their output in a vector of chunks, which is written out
+ * with a single writev when the command finishes. */
+typedef struct outbuf {
+  struct iovec *iov; /* chunks of output in order */
+  bool *owned;       /* chunk was allocated by us and must be freed */
+  int iovcnt;        /* number of chunks */
+  int iovmax;        /* capacity of arrays above */
+} outbuf_t;
+
+static void bput(outbuf_t *ob, const char *s, size_t len, bool owned) {
+  if (len == 0) {
+    if (owned)
+      free((void *)s);
+    return;
+  }
+  if (ob->iovcnt == ob->iovmax) {
+    ob->iovmax = ob->iovmax ? ob->iovmax * 2 : 16;
+    ob->iov = realloc(ob->iov, sizeof(struct iovec) * ob->iovmax);
+    ob->owned = realloc(ob->owned, sizeof(bool) * ob->iovmax);
+  }
+  ob->iov[ob->iovcnt] = (struct iovec){.iov_base = (void *)s, .iov_len = len};
+  ob->owned[ob->iovcnt++] = owned;
+}
+
+/* Append a string that outlives the buffer, hence it's not copied. */
+static void bputs(outbuf_t *ob, const char *s) {
+  bput(ob, s, strlen(s), false);
+}
+
+static __attribute__((format(printf, 2, 3))) void
+bprintf(outbuf_t *ob, const char *fmt, ...) {
+  va_list ap;
+  char *s;
+  va_start(ap, fmt);
+  int len = vasprintf(&s, fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    unix_error("vasprintf error");
+  bput(ob, s, len, true);
+}
+
+static void bfree(outbuf_t *ob) {
+  for (int i = 0; i < ob->iovcnt; i++)
+    if (ob->owned[i])
+      free(ob->iov[i].iov_base);
+  free(ob->iov);
+  free(ob->owned);
+}
+
+/* Concatenate all chunks into a string and release the buffer. */
+static char *bjoin(outbuf_t *ob) {
+  size_t len = 0;
+  for (int i = 0; i < ob->iovcnt; i++)
+    len += ob->iov[i].iov_len;
+  char *s = malloc(len + 1), *p = s;
+  for (int i = 0; i < ob->iovcnt; i++)
+    p = mempcpy(p, ob->iov[i].iov_base, ob->iov[i].iov_len);
+  *p = '\0';
+  bfree(ob);
+  return s;
+}
+
+/* Write out all chunks and release the buffer. Returns -1 on write error. */
+static int bflush(outbuf_t *ob, int fd) {
+  struct iovec *iov = ob->iov;
+  int iovcnt = ob->iovcnt;
+  int rc = 0;
+
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, min(iovcnt, IOV_MAX));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      rc = -1;
+      break;
+    }
+    for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+      n -= iov->iov_len;
+    if (n > 0) {
+      iov->iov_base += n;
+      iov->iov_len -= n;
+    }
+  }
+
+  bfree(ob);
+  return rc;
+}
+
+/* Returns true if SIGPIPE is waiting to be delivered to the caller. */
+static bool sigpipe_p(void) {
+  sigset_t pending;
+  return sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE);
+}
+
+/* Flush output of a builtin and turn write error into an exit code. */
+static int bfinish(outbuf_t *ob, io_t *io, const char *name, int exitcode) {
+  if (bflush(ob, io->out) < 0) {
+    /* A builtin on a thread of the shell has SIGPIPE blocked. It ends
+     * quietly like a process killed by the signal would. */
+    if (errno != EPIPE || !sigpipe_p())
+      bmsg(io, "%s: write error: %s\n", name, strerror(errno));
+    return 1;
+  }
+  return exitcode;
+}
+
+/* Expand backslash escape sequence at `s` into the buffer.
+ * Returns number of characters consumed or -1 for '\c' (stop output). */
+static int escape(outbuf_t *ob, const char *s, bool octal0) {
+  static const char from[] = "abefnrtv\\";
+  static const char to[] = "\a\b\033\f\n\r\t\v\\";
+  const char *p = s + 1;
+
+  if (*p == 'c')
+    return -1;
+
+  const char *e = *p ? index(from, *p) : NULL;
+  if (e) {
+    bput(ob, &to[e - from], 1, false);
+    return 2;
+  }
+
+  /* Octal escapes are '\0nnn' for echo and '\nnn' for printf format. */
+  if (octal0 ? *p == '0' : (*p >= '0' && *p <= '7')) {
+    if (octal0)
+      p++;
+    int c = 0, n = 0;
+    for (; n < 3 && *p >= '0' && *p <= '7'; n++, p++)
+      c = c * 8 + (*p - '0');
+    char *ch = malloc(1);
+    *ch = c;
+    bput(ob, ch, 1, true);
+    return p - s;
+  }
+
+  bput(ob, s, 1, false);
+  return 1;
+}
+
+/* Copy a string into the buffer expanding escapes. Returns false on '\c'. */
+static bool unescape(outbuf_t *ob, const char *s, bool octal0) {
+  while (*s) {
+    size_t len = strcspn(s, "\\");
+    bput(ob, s, len, false);
+    s += len;
+    if (*s == '\0')
+      break;
+    int n = escape(ob, s, octal0);
+    if (n < 0)
+      return false;
+    s += n;
+  }
+  return true;
+}
+
+/*
+ * Print arguments separated by single space and followed by a newline.
+ * 'echo -n ...' - do not print trailing newline
+ * 'echo -e ...' - interpret backslash escapes
+ */
+static int do_echo(char **argv, io_t *io) {
+  outbuf_t ob = {};
+  bool newline = true, escapes = false;
+
+  for (; *argv && (*argv)[0] == '-' && (*argv)[1]; argv++) {
+    const char *opt = *argv + 1;
+    if (strspn(opt, "neE") != strlen(opt))
+      break;
+    for (; *opt; opt++) {
+      if (*opt == 'n')
+        newline = false;
+      else
+        escapes = (*opt == 'e');
+    }
+  }
+
+  for (; *argv; argv++) {
+    if (!escapes) {
+      bputs(&ob, *argv);
+    } else if (!unescape(&ob, *argv, true)) {
+      newline = false;
+      break;
+    }
+    if (argv[1])
+      bputs(&ob, " ");
+  }
+
+  if (newline)
+    bputs(&ob, "\n");
+
+  return bfinish(&ob, io, "echo", 0);
+}
+
+/* Parse numeric argument of printf, an empty argument yields zero.
+ * Character constant like 'a or "a gives code of the character. */
+static bool printf_number(io_t *io, const char *arg, long long *valp,
+                          bool is_signed) {
+  char *end;
+
+  if (arg == NULL || *arg == '\0') {
+    *valp = 0;
+    return true;
+  }
+  if (arg[0] == '\'' || arg[0] == '"') {
+    *valp = (unsigned char)arg[1];
+    return true;
+  }
+  errno = 0;
+  *valp = is_signed ? strtoll(arg, &end, 0) : (long long)strtoull(arg, &end, 0);
+  if (errno || *end) {
+    bmsg(io, "printf: %s: invalid number\n", arg);
+    return false;
+  }
+  return true;
+}
+
+#define SPECSIZE 64 /* longest conversion specification passed to printf(3) */
+
+/* Append `len` characters to conversion specification. Its length `*np`
+ * keeps growing when it doesn't fit, so that it can be rejected later. */
+static void specput(char *spec, int *np, const char *s, int len) {
+  if (*np + len < SPECSIZE)
+    memcpy(spec + *np, s, len);
+  *np += len;
+}
+
+/*
+ * Print arguments according to format, like printf(3).
+ * Format is reused as long as there are arguments left.
+ * 'printf format [arguments]'
+ */
+static int do_printf(char **argv, io_t *io) {
+  if (argv[0] == NULL) {
+    bmsg(io, "printf: usage: printf format [arguments]\n");
+    return 2;
+  }
+
+  outbuf_t ob = {};
+  const char *fmt = *argv++;
+  int exitcode = 0;
+
+  do {
+    char **first = argv;
+
+    for (const char *p = fmt; *p;) {
+      size_t len = strcspn(p, "\\%");
+      bput(&ob, p, len, false);
+      p += len;
+
+      if (*p == '\\') {
+        int n = escape(&ob, p, false);
+        if (n < 0)
+          return bfinish(&ob, io, "printf", exitcode);
+        p += n;
+        continue;
+      }
+
+      if (*p == '\0')
+        break;
+
+      if (p[1] == '%') {
+        bputs(&ob, "%");
+        p += 2;
+        continue;
+      }
+
+      /* Rebuild conversion specification for our own use of printf(3).
+       * Width and precision given as '*' are taken from arguments. */
+      const char *start = p;
+      char spec[SPECSIZE];
+      int n = 0;
+      spec[n++] = *p++;
+      for (; *p && index("-+ #0", *p); p++)
+        specput(spec, &n, p, 1);
+      for (int prec = 0; prec < 2; prec++) {
+        if (prec) {
+          if (*p != '.')
+            break;
+          specput(spec, &n, p++, 1);
+        }
+        if (*p == '*') {
+          long long val;
+          if (!printf_number(io, *argv, &val, true))
+            exitcode = 1;
+          if (*argv)
+            argv++;
+          char num[16];
+          specput(spec, &n, num, snprintf(num, sizeof(num), "%d", (int)val));
+          p++;
+        } else {
+          for (; isdigit(*p); p++)
+            specput(spec, &n, p, 1);
+        }
+      }
+
+      char conv = *p ? *p++ : '\0';
+      /* Leave room for length modifier, conversion and terminating NUL. */
+      if (n + 4 > SPECSIZE) {
+        bmsg(io, "printf: %.*s: invalid conversion\n", (int)(p - start),
+             start);
+        return bfinish(&ob, io, "printf", 1);
+      }
+      const char *arg = *argv ? *argv++ : NULL;
+      long long val;
+
+      switch (conv) {
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+          if (!printf_number(io, arg, &val, index("di", conv)))
+            exitcode = 1;
+          spec[n++] = 'l';
+          spec[n++] = 'l';
+          spec[n++] = conv;
+          spec[n] = '\0';
+          bprintf(&ob, spec, val);
+          break;
+        case 'c':
+          spec[n++] = 'c';
+          spec[n] = '\0';
+          bprintf(&ob, spec, arg ? arg[0] : '\0');
+          break;
+        case 's':
+          spec[n++] = 's';
+          spec[n] = '\0';
+          bprintf(&ob, spec, arg ? arg : "");
+          break;
+        case 'b': {
+          outbuf_t tmp = {};
+          bool cont = unescape(&tmp, arg ? arg : "", true);
+          char *str = bjoin(&tmp);
+          spec[n++] = 's';
+          spec[n] = '\0';
+          bprintf(&ob, spec, str);
+          free(str);
+          if (!cont)
+            return bfinish(&ob, io, "printf", exitcode);
+          break;
+        }
+        default:
+          bmsg(io, "printf: %%%c: invalid conversion\n", conv);
+          return bfinish(&ob, io, "printf", 1);
+      }
+    }
+
+    /* Stop if format did not consume any argument. */
+    if (argv == first)
+      break;
+  } while (*argv);
+
+  return bfinish(&ob, io, "printf", exitcode);
+}
+
+/* State of recursive descent parser for 'test' expressions. */
+typedef struct tparser {
+  char **argv; /* remaining arguments */
+  int argc;    /* number of remaining arguments */
+  bool error;  /* syntax error was found */
+  io_t *io;    /* standard streams of the command */
+} tparser_t;
+
+static bool test_or(tparser_t *tp);
+
+static const char *tnext(tparser_t *tp) {
+  if (tp->argc == 0) {
+    tp->error = true;
+    return "";
+  }
+  tp->argc--;
+  return *tp->argv++;
+}
+
+static bool tpeek(tparser_t *tp, const char *s) {
+  return tp->argc > 0 && !strcmp(tp->argv[0], s);
+}
+
+static bool test_integer(tparser_t *tp, const char *s, long long *valp) {
+  char *end;
+  errno = 0;
+  *valp = strtoll(s, &end, 10);
+  if (errno || *s == '\0' || *end) {
+    bmsg(tp->io, "test: %s: integer expression expected\n", s);
+    tp->error = true;
+    return false;
+  }
+  return true;
+}
+
+static bool test_unary(tparser_t *tp, char op, const char *arg) {
+  struct stat sb;
+
+  switch (op) {
+    case 'n':
+      return *arg != '\0';
+    case 'z':
+      return *arg == '\0';
+    case 't': {
+      long long fd;
+      return test_integer(tp, arg, &fd) && isatty(fd);
+    }
+    case 'h':
+    case 'L':
+      return !lstat(arg, &sb) && S_ISLNK(sb.st_mode);
+    case 'r':
+      return !access(arg, R_OK);
+    case 'w':
+      return !access(arg, W_OK);
+    case 'x':
+      return !access(arg, X_OK);
+  }
+
+  if (stat(arg, &sb) < 0)
+    return false;
+
+  switch (op) {
+    case 'e':
+      return true;
+    case 'f':
+      return S_ISREG(sb.st_mode);
+    case 'd':
+      return S_ISDIR(sb.st_mode);
+    case 'b':
+      return S_ISBLK(sb.st_mode);
+    case 'c':
+      return S_ISCHR(sb.st_mode);
+    case 'p':
+      return S_ISFIFO(sb.st_mode);
+    case 'S':
+      return S_ISSOCK(sb.st_mode);
+    case 's':
+      return sb.st_size > 0;
+    case 'u':
+      return sb.st_mode & S_ISUID;
+    case 'g':
+      return sb.st_mode & S_ISGID;
+    case 'k':
+      return sb.st_mode & S_ISVTX;
+  }
+  return false;
+}
+
+static const char *binops[] = {"=",   "==",  "!=",  "<",   ">",   "-eq",
+                               "-ne", "-lt", "-le", "-gt", "-ge", "-nt",
+                               "-ot", "-ef", NULL};
+
+static bool test_binop_p(const char *s) {
+  for (const char **op = binops; *op; op++)
+    if (!strcmp(s, *op))
+      return true;
+  return false;
+}
+
+static bool test_binary(tparser_t *tp, const char *l, const char *op,
+                        const char *r) {
+  if (!strcmp(op, "=") || !strcmp(op, "=="))
+    return !strcmp(l, r);
+  if (!strcmp(op, "!="))
+    return strcmp(l, r);
+  if (!strcmp(op, "<"))
+    return strcmp(l, r) < 0;
+  if (!strcmp(op, ">"))
+    return strcmp(l, r) > 0;
+
+  if (op[1] == 'n' || op[1] == 'o' || !strcmp(op, "-ef")) {
+    struct stat ls, rs;
+    bool lok = !stat(l, &ls), rok = !stat(r, &rs);
+    if (!strcmp(op, "-ef"))
+      return lok && rok && ls.st_dev == rs.st_dev && ls.st_ino == rs.st_ino;
+    if (!strcmp(op, "-nt"))
+      return lok && (!rok || ls.st_mtim.tv_sec > rs.st_mtim.tv_sec ||
+                     (ls.st_mtim.tv_sec == rs.st_mtim.tv_sec &&
+                      ls.st_mtim.tv_nsec > rs.st_mtim.tv_nsec));
+    if (!strcmp(op, "-ot"))
+      return rok && (!lok || ls.st_mtim.tv_sec < rs.st_mtim.tv_sec ||
+                     (ls.st_mtim.tv_sec == rs.st_mtim.tv_sec &&
+                      ls.st_mtim.tv_nsec < rs.st_mtim.tv_nsec));
+  }
+
+  long long a, b;
+  if (!test_integer(tp, l, &a) || !test_integer(tp, r, &b))
+    return false;
+  if (!strcmp(op, "-eq"))
+    return a == b;
+  if (!strcmp(op, "-ne"))
+    return a != b;
+  if (!strcmp(op, "-lt"))
+    return a < b;
+  if (!strcmp(op, "-le"))
+    return a <= b;
+  if (!strcmp(op, "-gt"))
+    return a > b;
+  return a >= b;
+}
+
+static bool test_primary(tparser_t *tp) {
+  if (tpeek(tp, "!")) {
+    tnext(tp);
+    return !test_primary(tp);
+  }
+
+  /* Binary operator takes precedence, so that 'test -n = -n' works. */
+  if (tp->argc >= 3 && test_binop_p(tp->argv[1])) {
+    const char *l = tnext(tp), *op = tnext(tp), *r = tnext(tp);
+    return test_binary(tp, l, op, r);
+  }
+
+  if (tpeek(tp, "(")) {
+    tnext(tp);
+    bool res = test_or(tp);
+    if (strcmp(tnext(tp), ")"))
+      tp->error = true;
+    return res;
+  }
+
+  const char *arg = tnext(tp);
+  if (tp->argc > 0 && arg[0] == '-' && arg[1] && !arg[2] &&
+      index("bcdefghLnprsStuwxzk", arg[1]))
+    return test_unary(tp, arg[1], tnext(tp));
+
+  return *arg != '\0';
+}
+
+static bool test_and(tparser_t *tp) {
+  bool res = test_primary(tp);
+  while (tpeek(tp, "-a")) {
+    tnext(tp);
+    res = test_primary(tp) && res;
+  }
+  return res;
+}
+
+static bool test_or(tparser_t *tp) {
+  bool res = test_and(tp);
+  while (tpeek(tp, "-o")) {
+    tnext(tp);
+    res = test_and(tp) || res;
+  }
+  return res;
+}
+
+/*
+ * Evaluate conditional expression.
+ * 'test expr' or '[ expr ]'
+ * Exit code is 0 if expression is true, 1 if false, 2 on error.
+ */
+static int do_test(char **argv, io_t *io) {
+  tparser_t tp = {.argv = argv, .io = io};
+
+  while (argv[tp.argc])
+    tp.argc++;
+
+  if (tp.argc == 0)
+    return 1;
+
+  bool res = test_or(&tp);
+
+  if (tp.error || tp.argc > 0) {
+    if (!tp.error)
+      bmsg(io, "test: %s: unexpected argument\n", tp.argv[0]);
+    return 2;
+  }
+  return res ? 0 : 1;
+}
+
+static int do_bracket(char **argv, io_t *io) {
+  int argc = 0;
+
+  while (argv[argc])
+    argc++;
+
+  if (argc == 0 || strcmp(argv[argc - 1], "]")) {
+    bmsg(io, "[: missing ']'\n");
+    return 2;
+  }
+
+  char *bracket = argv[argc - 1];
+  argv[argc - 1] = NULL;
+  int exitcode = do_test(argv, io);
+  argv[argc - 1] = bracket;
+  return exitcode;
+}
+
+static int do_true(char **argv, io_t *io) {
+  return 0;
+}
+
+static int do_false(char **argv, io_t *io) {
+  return 1;
+}
+
+#define TEE_CHUNK 65536 /* most bytes moved by a round of `tee` or `copy` */
+
+/* Returns true if data can be spliced into the descriptor. It's not possible
+ * for files opened for appending and for terminals. */
+static bool spliceable_p(int fd) {
+  struct stat sb;
+  if (fstat(fd, &sb) < 0 || (fcntl(fd, F_GETFL) & O_APPEND))
+    return false;
+  return S_ISFIFO(sb.st_mode) || S_ISREG(sb.st_mode) || S_ISSOCK(sb.st_mode);
+}
+
+static bool fifo_p(int fd) {
+  struct stat sb;
+  return fstat(fd, &sb) == 0 && S_ISFIFO(sb.st_mode);
+}
+
+/* Move `len` bytes from pipe `in` to `out`. Returns number of bytes moved,
+ * which is less than `len` only on error. */
+static size_t splice_all(int in, int out, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = splice(in, NULL, out, NULL, len - done, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+/* Drop `len` bytes from pipe `in`, that a failed output didn't take. */
+static void discard(int in, size_t len) {
+  int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    (void)splice_all(in, fd, len);
+    Close(fd);
+  }
+}
+
+/* Data waiting in the input pipe is duplicated with tee(2) into a private
+ * pipe, which gets spliced into an output. Pipes pass references to pages,
+ * so data is not copied through user space. The last working output consumes
+ * input. An output that fails gets its errno stored in `error` and is skipped
+ * from then on. Returns -1 if input failed, 0 at its end or a positive
+ * number otherwise. */
+static ssize_t tee_splice(int in, int *out, int *error, int nout,
+                          int buf[2]) {
+  ssize_t len = TEE_CHUNK;
+  bool teed = false;
+  int last = nout - 1;
+  while (error[last])
+    last--;
+
+  for (int i = 0; i < last; i++) {
+    if (error[i])
+      continue;
+    ssize_t n;
+    while ((n = tee(in, buf[1], len, 0)) < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n;
+    /* Private pipe is as large as the input one, so all of it fits. */
+    if (teed && n < len)
+      return errno = EIO, -1;
+    len = n;
+    teed = true;
+    size_t done = splice_all(buf[0], out[i], len);
+    if (done < (size_t)len) {
+      error[i] = errno;
+      discard(buf[0], len - done);
+    }
+  }
+
+  if (!teed) {
+    while ((len = splice(in, NULL, out[last], NULL, len, SPLICE_F_MOVE)) < 0 &&
+           errno == EINTR)
+      continue;
+    if (len < 0) {
+      error[last] = errno;
+      return 1;
+    }
+    return len;
+  }
+  size_t done = splice_all(in, out[last], len);
+  if (done < (size_t)len) {
+    error[last] = errno;
+    discard(in, len - done);
+  }
+  return len;
+}
+
+/* Copy data through a buffer, if input or some output isn't spliceable.
+ * Failed outputs are handled like in `tee_splice`. */
+static ssize_t tee_copy(int in, int *out, int *error, int nout, char *chunk) {
+  ssize_t len;
+  while ((len = read(in, chunk, TEE_CHUNK)) < 0 && errno == EINTR)
+    continue;
+  for (int i = 0; i < nout && len > 0; i++)
+    if (!error[i] && rio_writen(out[i], chunk, len) < 0)
+      error[i] = errno;
+  return len;
+}
+
+/*
+ * Copy standard input to standard output and to files.
+ * 'tee -a ...' - append to files instead of overwriting them
+ */
+static int do_tee(char **argv, io_t *io) {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  int exitcode = 0;
+
+  for (; *argv && !strcmp(*argv, "-a"); argv++)
+    flags = (flags & ~O_TRUNC) | O_APPEND;
+
+  int nfiles = 0;
+  while (argv[nfiles])
+    nfiles++;
+
+  /* Failed output keeps its errno in `error` until it's reported. */
+  const char *name[nfiles + 1];
+  int out[nfiles + 1], error[nfiles + 1], nout = 0;
+  name[nout] = "standard output";
+  error[nout] = 0;
+  out[nout++] = io->out;
+  for (; *argv; argv++) {
+    if ((out[nout] = open(*argv, flags, 0666)) < 0) {
+      bmsg(io, "tee: %s: %s\n", *argv, strerror(errno));
+      exitcode = 1;
+    } else {
+      name[nout] = *argv;
+      error[nout++] = 0;
+    }
+  }
+
+  bool fast = fifo_p(io->in);
+  for (int i = 0; i < nout && fast; i++)
+    fast = spliceable_p(out[i]);
+
+  int buf[2] = {-1, -1};
+  char *chunk = NULL;
+  if (!fast)
+    chunk = malloc(TEE_CHUNK);
+  else if (nout > 1)
+    mkpipe(&buf[0], &buf[1], fcntl(io->in, F_GETPIPE_SZ));
+
+  ssize_t n;
+  int working = nout;
+  do {
+    n = fast ? tee_splice(io->in, out, error, nout, buf)
+             : tee_copy(io->in, out, error, nout, chunk);
+    int readerr = errno;
+    for (int i = 0; i < nout; i++) {
+      if (error[i] <= 0)
+        continue;
+      /* See `bfinish` for quiet end on a closed pipe. */
+      if (error[i] != EPIPE || !sigpipe_p())
+        bmsg(io, "tee: %s: %s\n", name[i], strerror(error[i]));
+      error[i] = -1;
+      exitcode = 1;
+      working--;
+    }
+    errno = readerr;
+  } while (n > 0 && working > 0);
+
+  if (n < 0) {
+    bmsg(io, "tee: %s\n", strerror(errno));
+    exitcode = 1;
+  }
+
+  if (buf[0] >= 0) {
+    Close(buf[0]);
+    Close(buf[1]);
+  }
+  free(chunk);
+  for (int i = 1; i < nout; i++)
+    Close(out[i]);
+  return exitcode;
+}
+
+/* Splice a chunk of data from `in` to `out`. One of them must be a pipe,
+ * otherwise data goes through private pipe `buf`. Returns number of bytes
+ * passed on or -1 on error. */
+static ssize_t copy_splice(int in, int out, int buf[2]) {
+  ssize_t n;
+  int to = buf[1] >= 0 ? buf[1] : out;
+  while ((n = splice(in, NULL, to, NULL, TEE_CHUNK, SPLICE_F_MOVE)) < 0 &&
+         errno == EINTR)
+    continue;
+  if (n > 0 && buf[0] >= 0 && splice_all(buf[0], out, n) < (size_t)n)
+    return -1;
+  return n;
+}
+
+/*
+ * Copy standard input to standard output. Data moves between files, pipes
+ * and sockets with splice(2), so it's not copied through user space, e.g.
+ * 'copy <log >unix:/run/collector.sock'.
+ */
+static int do_copy(char **argv, io_t *io) {
+  if (argv[0]) {
+    bmsg(io, "copy: usage: copy <input >output\n");
+    return 2;
+  }
+
+  bool fast = spliceable_p(io->in) && spliceable_p(io->out);
+  int buf[2] = {-1, -1};
+  char *chunk = NULL;
+  if (!fast)
+    chunk = malloc(TEE_CHUNK);
+  else if (!fifo_p(io->in) && !fifo_p(io->out))
+    mkpipe(&buf[0], &buf[1], 0);
+
+  ssize_t n;
+  int error = 0;
+  do {
+    n = fast ? copy_splice(io->in, io->out, buf)
+             : tee_copy(io->in, &io->out, &error, 1, chunk);
+    if (error)
+      errno = error, n = -1;
+  } while (n > 0);
+
+  if (n < 0 && (errno != EPIPE || !sigpipe_p()))
+    bmsg(io, "copy: %s\n", strerror(errno));
+
+  if (buf[0] >= 0) {
+    Close(buf[0]);
+    Close(buf[1]);
+  }
+  free(chunk);
+  return n < 0;
+}
+
+typedef struct alias {
+  LIST_ENTRY(alias) link; /* aliases with the same bucket */
+  uint32_t hash;          /* hash of alias name */
+  char *name;             /* name of the alias */
+  char *value;            /* text substituted for the name */
+} alias_t;
+
+static LIST_HEAD(, alias) aliases[NBUCKETS];
+static int naliases = 0;
+
+static alias_t *findalias(const char *name) {
+  uint32_t h = namehash(name);
+  alias_t *a;
+
+  LIST_FOREACH(a, &aliases[h & (NBUCKETS - 1)], link)
+    if (a->hash == h && !strcmp(a->name, name))
+      return a;
+  return NULL;
+}
+
+/* Called by parser for the first word of each command. */
+const char *getalias(const char *name) {
+  if (naliases == 0)
+    return NULL;
+  alias_t *a = findalias(name);
+  return a ? a->value : NULL;
+}
+
+static void setalias(const char *name, const char *value) {
+  alias_t *a = findalias(name);
+  if (a == NULL) {
+    a = malloc(sizeof(alias_t));
+    a->hash = namehash(name);
+    a->name = strdup(name);
+    LIST_INSERT_HEAD(&aliases[a->hash & (NBUCKETS - 1)], a, link);
+    naliases++;
+  } else {
+    free(a->value);
+  }
+  a->value = strdup(value);
+}
+
+static void delalias(alias_t *a) {
+  LIST_REMOVE(a, link);
+  free(a->name);
+  free(a->value);
+  free(a);
+  naliases--;
+}
+
+/* Append a string in single quotes, so that shell reads it back as is. */
+static void bputquoted(outbuf_t *ob, const char *s) {
+  bputs(ob, "'");
+  while (*s) {
+    size_t n = strcspn(s, "'");
+    bput(ob, strndup(s, n), n, true);
+    s += n;
+    if (*s) {
+      bputs(ob, "'\\''");
+      s++;
+    }
+  }
+  bputs(ob, "'");
+}
+
+/* Print alias definition in a form that can be read back by the shell. */
+static void print_alias(outbuf_t *ob, alias_t *a) {
+  bprintf(ob, "alias %s=", a->name);
+  bputquoted(ob, a->value);
+  bputs(ob, "\n");
+}
+
+static int alias_cmp(const void *a, const void *b) {
+  return strcmp((*(alias_t **)a)->name, (*(alias_t **)b)->name);
+}
+
+/*
+ * Define or display aliases.
+ * 'alias' - print all aliases sorted by name
+ * 'alias name=value ...' - define aliases
+ * 'alias name ...' - print given aliases
+ */
+static int do_alias(char **argv, io_t *io) {
+  outbuf_t ob = {};
+  int exitcode = 0;
+
+  if (argv[0] == NULL) {
+    alias_t *all[naliases], *a;
+    int n = 0;
+    for (int i = 0; i < NBUCKETS; i++)
+      LIST_FOREACH(a, &aliases[i], link)
+        all[n++] = a;
+    qsort(all, n, sizeof(alias_t *), alias_cmp);
+    for (int i = 0; i < n; i++)
+      print_alias(&ob, all[i]);
+    return bfinish(&ob, io, "alias", 0);
+  }
+
+  for (; *argv; argv++) {
+    char *eq = strchr(*argv, '=');
+    if (eq) {
+      char *name = strndup(*argv, eq - *argv);
+      setalias(name, eq + 1);
+      free(name);
+      /* Cached commands were parsed with previous definitions. */
+      flushcache();
+    } else {
+      alias_t *a = findalias(*argv);
+      if (a) {
+        print_alias(&ob, a);
+      } else {
+        bmsg(io, "alias: %s: not found\n", *argv);
+        exitcode = 1;
+      }
+    }
+  }
+
+  return bfinish(&ob, io, "alias", exitcode);
+}
+
+/*
+ * Remove aliases.
+ * 'unalias name ...' - remove given aliases
+ * 'unalias -a' - remove all aliases
+ */
+static int do_unalias(char **argv, io_t *io) {
+  int exitcode = 0;
+
+  if (argv[0] && !strcmp(argv[0], "-a")) {
+    for (int i = 0; i < NBUCKETS; i++)
+      while (!LIST_EMPTY(&aliases[i]))
+        delalias(LIST_FIRST(&aliases[i]));
+  } else {
+    for (; *argv; argv++) {
+      alias_t *a = findalias(*argv);
+      if (a) {
+        delalias(a);
+      } else {
+        bmsg(io, "unalias: %s: not found\n", *argv);
+        exitcode = 1;
+      }
+    }
+  }
+
+  flushcache();
+  return exitcode;
+}
+
+/* Compare "name=value" strings by names. */
+static int entry_cmp(const void *a, const void *b) {
+  const char *s = *(const char **)a, *t = *(const char **)b;
+  for (; *s == *t && *s != '='; s++, t++)
+    continue;
+  int c = *s == '=' ? 0 : (unsigned char)*s;
+  int d = *t == '=' ? 0 : (unsigned char)*t;
+  return c - d;
+}
+
+/*
+ * Export variables to environment of commands.
+ * 'export' or 'export -p' - print exported variables sorted by name
+ * 'export name=value ...' - set and export variables
+ * 'export name ...' - export variables
+ */
+static int do_export(char **argv, io_t *io) {
+  outbuf_t ob = {};
+  int exitcode = 0;
+
+  if (argv[0] == NULL || !strcmp(argv[0], "-p")) {
+    char **envp = getenvp(NULL);
+    int n = 0;
+    while (envp[n])
+      n++;
+    char *all[n];
+    memcpy(all, envp, sizeof(char *) * n);
+    qsort(all, n, sizeof(char *), entry_cmp);
+    for (int i = 0; i < n; i++) {
+      char *eq = strchr(all[i], '=');
+      bprintf(&ob, "export %.*s=", (int)(eq - all[i]), all[i]);
+      bputquoted(&ob, eq + 1);
+      bputs(&ob, "\n");
+    }
+    return bfinish(&ob, io, "export", 0);
+  }
+
+  for (; *argv; argv++) {
+    char *eq = strchr(*argv, '=');
+    size_t len = eq ? eq - *argv : strlen(*argv);
+    if (!varname_p(*argv, len)) {
+      bmsg(io, "export: %s: not a valid identifier\n", *argv);
+      exitcode = 1;
+    } else if (eq) {
+      char *name = strndup(*argv, len);
+      setvar(name, eq + 1, V_EXPORT);
+      free(name);
+    } else {
+      exportvar(*argv);
+    }
+  }
+
+  return exitcode;
+}
+
+/*
+ * Remove variables.
+ * 'unset name ...' - remove given variables
+ */
+static int do_unset(char **argv, io_t *io) {
+  int exitcode = 0;
+
+  if (argv[0] && !strcmp(argv[0], "-v"))
+    argv++;
+
+  for (; *argv; argv++) {
+    if (varname_p(*argv, strlen(*argv))) {
+      unsetvar(*argv);
+    } else {
+      bmsg(io, "unset: %s: not a valid identifier\n", *argv);
+      exitcode = 1;
+    }
+  }
+
+  return exitcode;
+}
+
+#define READ_CHUNK 512 /* most bytes peeked at by a single round of `read` */
+
+/* Append bytes read from `fd` up to a newline to `line`. Socket, e.g. one of
+ * a coprocess, is peeked at, so that nothing past the newline is consumed.
+ * Other files are read byte by byte for the same reason. Returns number of
+ * bytes read or -1 on error. */
+static ssize_t readline(int fd, char **linep, size_t *lenp) {
+  char chunk[READ_CHUNK];
+  bool peek = true;
 
-int builtin_command(char **argv) {
-  for (command_t *cmd = builtins; cmd->name; cmd++) {
-    if (strcmp(argv[0], cmd->name))
+  while (true) {
+    ssize_t n = peek ? recv(fd, chunk, sizeof(chunk), MSG_PEEK) : 1;
+    if (n < 0 && errno == ENOTSOCK) {
+      peek = false;
+      n = 1;
+    }
+    if (n > 0) {
+      char *nl = peek ? memchr(chunk, '\n', n) : NULL;
+      n = read(fd, chunk, nl ? nl - chunk + 1 : n);
+    }
+    if (n < 0 && errno == EINTR)
       continue;
-    return cmd->func(&argv[1]);
+    if (n <= 0)
+      return n < 0 ? -1 : (ssize_t)*lenp;
+    *linep = realloc(*linep, *lenp + n + 1);
+    memcpy(*linep + *lenp, chunk, n);
+    *lenp += n;
+    (*linep)[*lenp] = '\0';
+    if (chunk[n - 1] == '\n')
+      return *lenp;
+  }
+}
+
+/*
+ * Read a line from standard input and split it into variables.
+ * 'read' - store the line in REPLY
+ * 'read name ...' - store consecutive fields in names, the last one gets
+ *   the rest of the line
+ * Returns 1 at end of file.
+ */
+static int do_read(char **argv, io_t *io) {
+  static char *reply[] = {"REPLY", NULL};
+  if (argv[0] == NULL)
+    argv = reply;
+
+  for (char **name = argv; *name; name++) {
+    if (!varname_p(*name, strlen(*name))) {
+      bmsg(io, "read: %s: not a valid identifier\n", *name);
+      return 2;
+    }
+  }
+
+  char *line = NULL;
+  size_t len = 0;
+  if (readline(io->in, &line, &len) < 0) {
+    bmsg(io, "read: %s\n", strerror(errno));
+    free(line);
+    return 1;
+  }
+
+  bool eof = len == 0 || line[len - 1] != '\n';
+  if (!eof)
+    line[--len] = '\0';
+
+  char *field = line ? line : "";
+  for (; *argv; argv++) {
+    field += strspn(field, " \t");
+    size_t flen = argv[1] ? strcspn(field, " \t") : strlen(field);
+    if (!argv[1])
+      while (flen > 0 && strchr(" \t", field[flen - 1]))
+        flen--;
+    char *value = strndup(field, flen);
+    setvar(*argv, value, 0);
+    free(value);
+    field += flen;
+  }
+
+  free(line);
+  return eof;
+}
+
+/* Returns socket of coprocess stored in variable `name`, or -1. */
+static int coproc_channel(io_t *io, const char *name) {
+  const char *value = getvar(name);
+  struct stat sb;
+  int fd = value ? atoi(value) : -1;
+  if (fd < 0 || fstat(fd, &sb) < 0 || !S_ISSOCK(sb.st_mode)) {
+    bmsg(io, "coproc: %s: no such coprocess\n", name);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Run a command connected to the shell through a socket, that both ends can
+ * read and write, e.g. 'echo query >&$sql; read answer <&$sql'.
+ * 'coproc name cmd args...' - start cmd in the background, store the shell's
+ *   end of the socket in name and process id of cmd in name_PID
+ * 'coproc -s name' - shut down writing, so that cmd reads end of file
+ * 'coproc -c name' - close the socket and unset name
+ */
+static int do_coproc(char **argv, io_t *io) {
+  bool shut = argv[0] && !strcmp(argv[0], "-s");
+  bool closing = argv[0] && !strcmp(argv[0], "-c");
+  if (shut || closing)
+    argv++;
+
+  if (argv[0] == NULL || (!shut && !closing && argv[1] == NULL)) {
+    bmsg(io, "coproc: usage: coproc [-s | -c] name [cmd args...]\n");
+    return 2;
+  }
+
+  const char *name = argv[0];
+  if (!varname_p(name, strlen(name))) {
+    bmsg(io, "coproc: %s: not a valid identifier\n", name);
+    return 1;
   }
 
-  errno = ENOENT;
-  return -1;
+  if (shut || closing) {
+    int fd = coproc_channel(io, name);
+    if (fd < 0)
+      return 1;
+    if (shut) {
+      (void)shutdown(fd, SHUT_WR);
+    } else {
+      Close(fd);
+      unsetvar(name);
+    }
+    return 0;
+  }
+
+  /* Keep the shell's end out of the way of redirections. */
+  int sv[2];
+  Socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+  int fd = fcntl(sv[0], F_DUPFD_CLOEXEC, 10);
+  if (fd < 0)
+    unix_error("fcntl error");
+  Close(sv[0]);
+
+  pid_t pid = startcoproc(&argv[1], sv[1]);
+  Close(sv[1]);
+
+  char value[16];
+  snprintf(value, sizeof(value), "%d", fd);
+  setvar(name, value, 0);
+  char *pidvar = strdup(name);
+  strapp(&pidvar, "_PID");
+  snprintf(value, sizeof(value), "%d", pid);
+  setvar(pidvar, value, 0);
+  free(pidvar);
+  return 0;
 }
 
-noreturn void external_command(char **argv) {
-  const char *path = getenv("PATH");
+/*
+ * Keep redirections in the shell or replace the shell with a program.
+ * 'exec 3>file' - shell holds file open as descriptor 3
+ * 'exec 3>&-' - shell closes descriptor 3
+ * 'exec cmd args...' - execute cmd within shell's process
+ */
+static int do_exec(char **argv, io_t *io) {
+  if (argv[0] == NULL)
+    return 0;
+
+  /* Signals ignored by interactive shell would stay ignored by cmd. */
+  Signal(SIGINT, SIG_DFL);
+  Signal(SIGTSTP, SIG_DFL);
+  Signal(SIGTTIN, SIG_DFL);
+  Signal(SIGTTOU, SIG_DFL);
+  external_command(argv, search_path(argv[0]), NULL);
+}
+
+/*
+ * Leave a function.
+ * 'return' - with exit code of last command
+ * 'return n' - with exit code n
+ */
+static int do_return(char **argv, io_t *io) {
+  if (funcnest == 0) {
+    bmsg(io, "return: can only return from a function\n");
+    return 1;
+  }
+  evalskip = SKIP_RETURN;
+  return argv[0] ? atoi(argv[0]) & 255 : exitstatus;
+}
+
+#include "builtins.inc"
+
+static uint32_t namehash(const char *name) {
+  return jenkins_hash(name, strlen(name), BUILTIN_SEED);
+}
+
+static function_t *functions[NBUCKETS];
+static int nfunctions = 0;
+
+/* Find out whether name refers to a function, a builtin or an external
+ * command. Functions take precedence over builtins. Flags of a builtin are
+ * stored into `flagsp` if it's not NULL. */
+int lookup(const char *name, builtin_t *builtinp, int *flagsp,
+           function_t **funcp) {
+  uint32_t h = namehash(name);
+
+  if (nfunctions > 0) {
+    for (function_t *fn = functions[h & (NBUCKETS - 1)]; fn; fn = fn->next) {
+      if (fn->hash == h && !strcmp(fn->name, name)) {
+        *funcp = fn;
+        return C_FUNCTION;
+      }
+    }
+  }
+
+  const command_t *cmd = &builtins[h & BUILTIN_MASK];
+  if (cmd->name && !strcmp(name, cmd->name)) {
+    *builtinp = cmd->func;
+    if (flagsp)
+      *flagsp = cmd->flags;
+    return C_BUILTIN;
+  }
+
+  return C_EXTERNAL;
+}
+
+/* Define a function or replace its body. The function keeps a reference to
+ * the command it was parsed from. */
+void deffunc(const char *name, stage_t *body, cmd_t *cmd) {
+  uint32_t h = namehash(name);
+  function_t **fnp = &functions[h & (NBUCKETS - 1)], *fn;
+
+  for (fn = *fnp; fn; fn = fn->next)
+    if (fn->hash == h && !strcmp(fn->name, name))
+      break;
+
+  if (fn == NULL) {
+    fn = malloc(sizeof(function_t));
+    fn->hash = h;
+    fn->name = strdup(name);
+    fn->next = *fnp;
+    *fnp = fn;
+    nfunctions++;
+  } else {
+    freecmd(fn->cmd);
+  }
+
+  fn->body = body;
+  fn->cmd = holdcmd(cmd);
+}
+
+/* Look for an executable program in directories listed in PATH.
+ * Returns dynamically allocated path or NULL if program was not found. */
+char *search_path(const char *name) {
+  const char *path = getvar("PATH");
+
+  if (index(name, '/') || !path)
+    return NULL;
+
+  while (*path) {
+    size_t len = strcspn(path, ":");
+    /* Relative entries (including empty one) depend on working directory. */
+    if (len > 0 && path[0] == '/') {
+      char *file = strndup(path, len);
+      strapp(&file, "/");
+      strapp(&file, name);
+      struct stat sb;
+      if (!stat(file, &sb) && S_ISREG(sb.st_mode) && !access(file, X_OK))
+        return file;
+      free(file);
+    }
+    path += len;
+    if (*path == ':')
+      path++;
+  }
+
+  return NULL;
+}
+
+/* Programs found in PATH are remembered until it changes, i.e. `pathgen` is
+ * incremented. Stages of parsed commands keep pointers into this table. */
+typedef struct program {
+  struct program *next; /* next program in the same hash bucket */
+  uint32_t hash;        /* hash of program name */
+  char *name;           /* name of the program */
+  char *path;           /* where it was found */
+} program_t;
+
+static program_t *programs[NBUCKETS];
+static unsigned programgen; /* `pathgen` the table was filled for */
+
+static void flushprograms(void) {
+  for (int i = 0; i < NBUCKETS; i++) {
+    while (programs[i]) {
+      program_t *p = programs[i];
+      programs[i] = p->next;
+      free(p->name);
+      free(p->path);
+      free(p);
+    }
+  }
+}
+
+/* Returns path of a program found in PATH or NULL. It's valid until PATH
+ * changes. Programs that were not found are looked for again next time. */
+const char *findprogram(const char *name) {
+  if (programgen != pathgen) {
+    flushprograms();
+    programgen = pathgen;
+  }
+
+  uint32_t h = namehash(name);
+  program_t **pp = &programs[h & (NBUCKETS - 1)], *p;
+  for (p = *pp; p; p = p->next)
+    if (p->hash == h && !strcmp(p->name, name))
+      return p->path;
+
+  char *path = search_path(name);
+  if (path == NULL)
+    return NULL;
+  p = malloc(sizeof(program_t));
+  p->hash = h;
+  p->name = strdup(name);
+  p->path = path;
+  p->next = *pp;
+  *pp = p;
+  return path;
+}
+
+/* Replace shell's subprocess with a program. If the program was resolved by
+ * `search_path` try it first, but fall back to PATH lookup if it's gone.
+ * Program gets exported variables with `assigns` layered on top of them,
+ * which may also give PATH to search. */
+noreturn void external_command(char **argv, const char *resolved,
+                               char **assigns) {
+  const char *path = getvar("PATH");
+  for (char **assign = assigns; assign && *assign; assign++)
+    if (!strncmp(*assign, "PATH=", 5))
+      path = *assign + 5;
+
+  environ = getenvp(assigns);
+
+  if (resolved)
+    (void)execve(resolved, argv, environ);
 
   if (!index(argv[0], '/') && path) {
     /* TODO: For all paths in PATH construct an absolute path and execve it. */
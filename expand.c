@@ -0,0 +1,808 @@
+#include "shell.h"
+#include <fnmatch.h>
+#include <pwd.h>
+
+/* Expansion of words produced by the lexer. Parameters, arithmetic and
+ * tilde are expanded within the shell process, command and process
+ * substitutions are left to `cmdsubst` and `procsubst`. Then results are split
+ * into fields, fields that contain a pattern are replaced with matching paths
+ * and quotes are removed.
+ * Words without anything to expand are used as they are, see `needexp_p`. */
+
+typedef struct expander {
+  char **fields;   /* fields produced so far */
+  int nfields;     /* number of fields */
+  int maxfields;   /* capacity of `fields` */
+  char *buf;       /* field being built */
+  size_t len;      /* length of the field */
+  size_t size;     /* capacity of `buf` */
+  bool open;       /* field exists even if it is empty (e.g. "") */
+  bool atnull;     /* "$@" expanded to nothing within current quotes */
+  bool delimited;  /* field was just ended by IFS whitespace */
+  bool split;      /* results of unquoted expansions are split */
+  bool pattern;    /* quoted characters are escaped for fnmatch */
+  bool glob;       /* fields are subject to pathname expansion */
+  bool failed;     /* an error was reported */
+  const char *ifs; /* field separators */
+} expander_t;
+
+static void expand(expander_t *e, const char *s, const char *end, bool quoted);
+
+static void putch(expander_t *e, char c) {
+  if (e->len + 1 >= e->size) {
+    e->size = e->size ? e->size * 2 : 64;
+    e->buf = realloc(e->buf, e->size);
+  }
+  e->buf[e->len++] = c;
+  e->open = true;
+  e->delimited = false;
+}
+
+/* Put a character that must be taken literally. */
+static void putlit(expander_t *e, char c) {
+  if (e->pattern && strchr("*?[]\\", c))
+    putch(e, '\\');
+  putch(e, c);
+}
+
+static void addfield(expander_t *e, char *field) {
+  if (e->nfields + 1 >= e->maxfields) {
+    e->maxfields = e->maxfields ? e->maxfields * 2 : 8;
+    e->fields = realloc(e->fields, sizeof(char *) * e->maxfields);
+  }
+  e->fields[e->nfields++] = field;
+}
+
+/* Finish a field. A pattern is replaced with paths it matches, if there are
+ * any. Otherwise characters escaped for pattern matching are unescaped. */
+static void endfield(expander_t *e) {
+  char *field = strndup(e->buf ? e->buf : "", e->len);
+  e->len = 0;
+  e->open = false;
+
+  if (e->glob) {
+    char **paths;
+    if (pattern_p(field) && globpath(field, &paths) > 0) {
+      for (int i = 0; paths[i]; i++)
+        addfield(e, paths[i]);
+      free(paths);
+      free(field);
+      return;
+    }
+    unescape_pattern(field);
+  }
+  addfield(e, field);
+}
+
+/* Put result of an expansion. Unless it was quoted it's split into fields
+ * at characters from IFS. IFS whitespace at the beginning and at the end
+ * of the result is ignored, other separators delimit fields on their own. */
+static void putvalue(expander_t *e, const char *v, bool quoted) {
+  if (quoted) {
+    for (; *v; v++)
+      putlit(e, *v);
+    return;
+  }
+  if (!e->split) {
+    for (; *v; v++)
+      putch(e, *v);
+    return;
+  }
+
+  for (; *v; v++) {
+    if (!strchr(e->ifs, *v)) {
+      /* Backslash is not special in results of expansion. */
+      if (e->glob && *v == '\\')
+        putch(e, '\\');
+      putch(e, *v);
+    } else if (isspace(*v)) {
+      if (e->open) {
+        endfield(e);
+        e->delimited = true;
+      }
+    } else {
+      if (!e->delimited)
+        endfield(e);
+      e->delimited = false;
+    }
+  }
+}
+
+/* Find end of `${...}`, `$((...))` or `$(...)` that begins at `s`. */
+static const char *skipexp(const char *s) {
+  if (s[1] == '(' && s[2] != '(') {
+    s = skipcmd(s + 2);
+    return *s ? s + 1 : s;
+  }
+
+  if (s[1] == '{') {
+    for (s += 2; *s && *s != '}'; s++) {
+      if (*s == CTLESC && s[1])
+        s++;
+      else if (*s == '$' && (s[1] == '{' || s[1] == '('))
+        s = skipexp(s) - 1;
+    }
+    return *s ? s + 1 : s;
+  }
+
+  int depth = 2;
+  for (s += 3; *s; s++) {
+    if (*s == CTLESC && s[1])
+      s++;
+    else if (*s == '$' && (s[1] == '{' || (s[1] == '(' && s[2] != '(')))
+      s = skipexp(s) - 1;
+    else if (*s == '(')
+      depth++;
+    else if (*s == ')' && --depth == 0)
+      return s + 1;
+  }
+  return s;
+}
+
+/* Expand part of a word into a single string without field splitting. */
+static char *expandstr(expander_t *parent, const char *s, const char *end,
+                       bool pattern) {
+  expander_t e = {.pattern = pattern, .ifs = parent->ifs};
+  expand(&e, s, end, false);
+  if (e.failed)
+    parent->failed = true;
+  putch(&e, '\0');
+  return e.buf;
+}
+
+/*
+ * Arithmetic expansion. Supports integer constants, variables, C operators
+ * with their usual precedence and assignments. Subexpressions that are not
+ * evaluated due to short-circuiting do not assign.
+ */
+
+typedef struct arith {
+  const char *s; /* next character of expression */
+  int noeval;    /* nonzero if side effects are suppressed */
+  bool error;    /* syntax error or division by zero */
+} arith_t;
+
+static long arith_expr(arith_t *a);
+
+static void arith_blank(arith_t *a) {
+  while (isspace(*a->s))
+    a->s++;
+}
+
+/* Operators are matched greedily, so two character ones go first. */
+static const char *arith_ops[] = {
+  "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "+=", "-=", "*=", "/=",
+  "%=", "+",  "-",  "*",  "/",  "%",  "<",  ">",  "&",  "|",  "^",  "!",
+  "~",  "?",  ":",  "(",  ")",  "=",  NULL,
+};
+
+static const char *arith_peek(arith_t *a) {
+  arith_blank(a);
+  for (const char **op = arith_ops; *op; op++)
+    if (!strncmp(a->s, *op, strlen(*op)))
+      return *op;
+  return NULL;
+}
+
+static bool arith_op(arith_t *a, const char *op) {
+  const char *next = arith_peek(a);
+  if (next == NULL || strcmp(next, op))
+    return false;
+  a->s += strlen(op);
+  return true;
+}
+
+static long arith_varvalue(const char *name, size_t len) {
+  const char *v = getvarn(name, len);
+  return v ? strtol(v, NULL, 0) : 0;
+}
+
+static long arith_primary(arith_t *a) {
+  arith_blank(a);
+
+  if (*a->s == '(') {
+    a->s++;
+    long v = arith_expr(a);
+    if (!arith_op(a, ")"))
+      a->error = true;
+    return v;
+  }
+
+  if (isdigit(*a->s)) {
+    char *end;
+    long v = strtol(a->s, &end, 0);
+    a->s = end;
+    return v;
+  }
+
+  const char *name = a->s;
+  while (isalnum(*a->s) || *a->s == '_')
+    a->s++;
+  size_t len = a->s - name;
+  if (!varname_p(name, len)) {
+    a->error = true;
+    return 0;
+  }
+
+  const char *op = arith_peek(a);
+  if (op && (!strcmp(op, "=") || (op[1] == '=' && !strchr("=!<>", op[0])))) {
+    a->s += strlen(op);
+    long v = arith_expr(a), old = arith_varvalue(name, len);
+    switch (op[0]) {
+      case '+':
+        v = old + v;
+        break;
+      case '-':
+        v = old - v;
+        break;
+      case '*':
+        v = old * v;
+        break;
+      case '/':
+      case '%':
+        if (v == 0) {
+          a->error = true;
+          return 0;
+        }
+        v = op[0] == '/' ? old / v : old % v;
+        break;
+    }
+    if (!a->noeval && !a->error) {
+      char *var = strndup(name, len), num[32];
+      snprintf(num, sizeof(num), "%ld", v);
+      setvar(var, num, 0);
+      free(var);
+    }
+    return v;
+  }
+
+  return arith_varvalue(name, len);
+}
+
+static long arith_unary(arith_t *a) {
+  if (arith_op(a, "-"))
+    return -arith_unary(a);
+  if (arith_op(a, "+"))
+    return arith_unary(a);
+  if (arith_op(a, "!"))
+    return !arith_unary(a);
+  if (arith_op(a, "~"))
+    return ~arith_unary(a);
+  return arith_primary(a);
+}
+
+/* Binary operators from the lowest to the highest precedence. */
+static const char *binops[][5] = {
+  {"|", NULL},        {"^", NULL},        {"&", NULL},
+  {"==", "!=", NULL}, {"<=", ">=", "<", ">", NULL},
+  {"<<", ">>", NULL}, {"+", "-", NULL},   {"*", "/", "%", NULL},
+};
+
+#define NLEVELS (int)(sizeof(binops) / sizeof(binops[0]))
+
+static long arith_binary(arith_t *a, int level) {
+  if (level == NLEVELS)
+    return arith_unary(a);
+
+  long l = arith_binary(a, level + 1);
+  while (true) {
+    const char **op;
+    for (op = binops[level]; *op; op++)
+      if (arith_op(a, *op))
+        break;
+    if (*op == NULL)
+      return l;
+
+    long r = arith_binary(a, level + 1);
+    if (((*op)[0] == '/' || (*op)[0] == '%') && r == 0) {
+      if (!a->noeval) {
+        a->error = true;
+        return 0;
+      }
+      r = 1; /* result is discarded anyway, e.g. in `0 && 1/0` */
+    }
+
+    if (!strcmp(*op, "|"))
+      l |= r;
+    else if (!strcmp(*op, "^"))
+      l ^= r;
+    else if (!strcmp(*op, "&"))
+      l &= r;
+    else if (!strcmp(*op, "=="))
+      l = (l == r);
+    else if (!strcmp(*op, "!="))
+      l = (l != r);
+    else if (!strcmp(*op, "<="))
+      l = (l <= r);
+    else if (!strcmp(*op, ">="))
+      l = (l >= r);
+    else if (!strcmp(*op, "<"))
+      l = (l < r);
+    else if (!strcmp(*op, ">"))
+      l = (l > r);
+    else if (!strcmp(*op, "<<"))
+      l <<= r;
+    else if (!strcmp(*op, ">>"))
+      l >>= r;
+    else if (!strcmp(*op, "+"))
+      l += r;
+    else if (!strcmp(*op, "-"))
+      l -= r;
+    else if (!strcmp(*op, "*"))
+      l *= r;
+    /* LONG_MIN / -1 overflows, which traps on x86, so it wraps around. */
+    else if (!strcmp(*op, "/"))
+      l = r == -1 ? (long)(0UL - (unsigned long)l) : l / r;
+    else
+      l = r == -1 ? 0 : l % r;
+  }
+}
+
+static long arith_and(arith_t *a) {
+  long l = arith_binary(a, 0);
+  while (arith_op(a, "&&")) {
+    a->noeval += !l;
+    long r = arith_binary(a, 0);
+    a->noeval -= !l;
+    l = l && r;
+  }
+  return l;
+}
+
+static long arith_or(arith_t *a) {
+  long l = arith_and(a);
+  while (arith_op(a, "||")) {
+    a->noeval += !!l;
+    long r = arith_and(a);
+    a->noeval -= !!l;
+    l = l || r;
+  }
+  return l;
+}
+
+static long arith_expr(arith_t *a) {
+  long c = arith_or(a);
+  if (!arith_op(a, "?"))
+    return c;
+  a->noeval += !c;
+  long t = arith_expr(a);
+  a->noeval -= !c;
+  if (!arith_op(a, ":")) {
+    a->error = true;
+    return 0;
+  }
+  a->noeval += !!c;
+  long f = arith_expr(a);
+  a->noeval -= !!c;
+  return c ? t : f;
+}
+
+/* Evaluate `$((...))` spanning from `s` to `end`. */
+static void expand_arith(expander_t *e, const char *s, const char *end) {
+  char *expr = expandstr(e, s + 3, end - 2, false);
+  arith_t a = {.s = expr};
+  long v = arith_expr(&a);
+  arith_blank(&a);
+  if (a.error || *a.s) {
+    msg("%s: arithmetic error\n", expr);
+    e->failed = true;
+  } else {
+    char num[32];
+    snprintf(num, sizeof(num), "%ld", v);
+    putvalue(e, num, true);
+  }
+  free(expr);
+}
+
+/*
+ * Parameters.
+ */
+
+static int nparams(void) {
+  int n = 0;
+  while (posparams[n])
+    n++;
+  return n;
+}
+
+/* Returns value of parameter, NULL if it's not set. Special parameters are
+ * formatted into `num`. */
+static const char *getparam(const char *name, size_t len, char num[32]) {
+  if (len == 1 && !isalnum(*name) && *name != '_') {
+    switch (*name) {
+      case '?':
+        snprintf(num, 32, "%d", exitstatus);
+        return num;
+      case '$':
+        snprintf(num, 32, "%d", rootpid);
+        return num;
+      case '!':
+        if (lastbgpid == 0)
+          return NULL;
+        snprintf(num, 32, "%d", lastbgpid);
+        return num;
+      case '#':
+        snprintf(num, 32, "%d", nparams());
+        return num;
+      case '-':
+        return "";
+    }
+    return NULL;
+  }
+  if (isdigit(*name)) {
+    int i = atoi(name);
+    if (i == 0)
+      return arg0;
+    return i <= nparams() ? posparams[i - 1] : NULL;
+  }
+  return getvarn(name, len);
+}
+
+/* Put "$@" or "$*". In double quotes "$@" gives a field per parameter. */
+static void putparams(expander_t *e, char which, bool quoted) {
+  if (quoted && which == '@' && posparams[0] == NULL)
+    e->atnull = true;
+  for (int i = 0; posparams[i]; i++) {
+    if (i > 0) {
+      if (which == '@' || !quoted) {
+        if (quoted || e->open)
+          endfield(e);
+      } else if (e->ifs[0]) {
+        putlit(e, e->ifs[0]);
+      }
+    }
+    putvalue(e, posparams[i], quoted);
+  }
+}
+
+/* Parse parameter name at `s`. Returns its length. */
+static size_t paramlen(const char *s) {
+  if (isdigit(*s) || (*s && strchr("@*#?$!-", *s)))
+    return 1;
+  size_t n = 0;
+  while (isalnum(s[n]) || s[n] == '_')
+    n++;
+  return n;
+}
+
+/* Remove prefix or suffix matching a pattern from value. */
+static char *trim(const char *value, const char *pat, char op, bool longest) {
+  size_t len = strlen(value);
+  char *v = strdup(value);
+
+  if (op == '#') {
+    for (size_t i = 0; i <= len; i++) {
+      size_t n = longest ? len - i : i;
+      char c = v[n];
+      v[n] = '\0';
+      bool match = !fnmatch(pat, v, 0);
+      v[n] = c;
+      if (match) {
+        memmove(v, v + n, len - n + 1);
+        return v;
+      }
+    }
+  } else {
+    for (size_t i = 0; i <= len; i++) {
+      size_t n = longest ? i : len - i;
+      if (!fnmatch(pat, v + n, 0)) {
+        v[n] = '\0';
+        return v;
+      }
+    }
+  }
+  return v;
+}
+
+/* Expand `${...}` spanning from `s` to `end`. */
+static void expand_brace(expander_t *e, const char *s, const char *end,
+                         bool quoted) {
+  const char *p = s + 2;
+  char num[32];
+
+  /* ${#name} is the length of a value. */
+  if (*p == '#' && p + 1 < end - 1 && p + 1 + paramlen(p + 1) == end - 1) {
+    p++;
+    size_t len = paramlen(p);
+    const char *v = getparam(p, len, num);
+    snprintf(num, sizeof(num), "%zu",
+             (*p == '@' || *p == '*') ? (size_t)nparams() : v ? strlen(v) : 0);
+    putvalue(e, num, true);
+    return;
+  }
+
+  size_t len = paramlen(p);
+  if (isdigit(*p))
+    while (isdigit(p[len]))
+      len++;
+  if (len == 0)
+    goto bad;
+
+  const char *name = p;
+  const char *v = getparam(name, len, num);
+  bool special = (len == 1 && (*name == '@' || *name == '*'));
+  p += len;
+
+  if (special && nparams() == 0)
+    v = NULL;
+
+  bool colon = (*p == ':');
+  if (colon)
+    p++;
+  char op = (p < end - 1) ? *p++ : '\0';
+  bool longest = false;
+  if ((op == '#' || op == '%') && *p == op) {
+    longest = true;
+    p++;
+  }
+  const char *word = p, *wend = end - 1;
+  bool unset = (v == NULL) || (colon && *v == '\0');
+
+  switch (op) {
+    case '\0':
+      if (colon)
+        goto bad;
+      break;
+    case '-':
+      if (unset) {
+        expand(e, word, wend, quoted);
+        return;
+      }
+      break;
+    case '+':
+      if (!unset)
+        expand(e, word, wend, quoted);
+      return;
+    case '=':
+    case '?': {
+      if (!unset)
+        break;
+      char *w = expandstr(e, word, wend, false);
+      if (op == '?' || !varname_p(name, len)) {
+        msg("%.*s: %s\n", (int)len, name,
+            (op == '?' && *w) ? w : "parameter not set");
+        e->failed = true;
+        free(w);
+        return;
+      }
+      char *var = strndup(name, len);
+      setvar(var, w, 0);
+      free(var);
+      putvalue(e, w, quoted);
+      free(w);
+      return;
+    }
+    case '#':
+    case '%': {
+      if (colon)
+        goto bad;
+      char *pat = expandstr(e, word, wend, true);
+      char *r = trim(v ? v : "", pat, op, longest);
+      putvalue(e, r, quoted);
+      free(r);
+      free(pat);
+      return;
+    }
+    default:
+    bad:
+      msg("%.*s: bad substitution\n", (int)(end - s), s);
+      e->failed = true;
+      return;
+  }
+
+  if (special)
+    putparams(e, *name, quoted);
+  else if (v)
+    putvalue(e, v, quoted);
+}
+
+/* Replace `$(...)` spanning from `s` to `end` with output of the command. */
+static void expand_cmd(expander_t *e, const char *s, const char *end,
+                       bool quoted) {
+  char *text = strndup(s + 2, end - s - 3);
+  char *output = cmdsubst(text);
+  free(text);
+  if (output == NULL) {
+    e->failed = true;
+    return;
+  }
+  putvalue(e, output, quoted);
+  free(output);
+}
+
+/* Replace `<(...)` or `>(...)` following CTLPROC at `s` with name of a pipe
+ * the command reads from or writes into. */
+static const char *expand_proc(expander_t *e, const char *s,
+                               const char *end) {
+  const char *last = skipcmd(s + 3);
+  char *text = strndup(s + 3, last - s - 3);
+  int fd = procsubst(text, s[1] == '>');
+  free(text);
+  if (fd < 0) {
+    e->failed = true;
+    return end;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "/dev/fd/%d", fd);
+  putvalue(e, name, true);
+  return last + 1;
+}
+
+/* Expand `$name`, `${...}`, `$((...))` or `$(...)` at `s`.
+ * Returns pointer to the first character after the expansion. */
+static const char *expand_dollar(expander_t *e, const char *s,
+                                 const char *end, bool quoted) {
+  char num[32];
+
+  if (s[1] == '{' || s[1] == '(') {
+    const char *last = skipexp(s);
+    if (last > end)
+      last = end;
+    if (s[1] == '{')
+      expand_brace(e, s, last, quoted);
+    else if (s[2] == '(')
+      expand_arith(e, s, last);
+    else
+      expand_cmd(e, s, last, quoted);
+    return last;
+  }
+
+  size_t len = (s + 1 < end) ? paramlen(s + 1) : 0;
+  if (len == 0) {
+    putch(e, '$');
+    return s + 1;
+  }
+  if (len == 1 && (s[1] == '@' || s[1] == '*')) {
+    putparams(e, s[1], quoted);
+  } else {
+    const char *v = getparam(s + 1, len, num);
+    if (v)
+      putvalue(e, v, quoted);
+  }
+  return s + 1 + len;
+}
+
+/* Replace `~` or `~user` at the beginning of a word with home directory. */
+static const char *expand_tilde(expander_t *e, const char *s,
+                                const char *end) {
+  const char *p = s + 1;
+  while (p < end && *p != '/' && *p != CTLESC && *p != CTLQUOTE && *p != '$')
+    p++;
+  if (p < end && *p != '/')
+    return s;
+
+  const char *home = NULL;
+  if (p == s + 1) {
+    home = getvar("HOME");
+  } else {
+    char *user = strndup(s + 1, p - s - 1);
+    struct passwd *pw = getpwnam(user);
+    free(user);
+    if (pw)
+      home = pw->pw_dir;
+  }
+  if (home == NULL)
+    return s;
+  putvalue(e, home, true);
+  return p;
+}
+
+static void expand(expander_t *e, const char *s, const char *end,
+                   bool quoted) {
+  if (s < end && *s == '~' && !quoted && !e->pattern)
+    s = expand_tilde(e, s, end);
+
+  while (s < end && !e->failed) {
+    if (*s == CTLESC && s + 1 < end) {
+      putlit(e, s[1]);
+      s += 2;
+    } else if (*s == CTLQUOTE) {
+      /* Empty quotes make an empty field, unless "$@" expanded to nothing. */
+      if (quoted && !e->atnull)
+        e->open = true;
+      quoted = !quoted;
+      e->atnull = false;
+      e->delimited = false;
+      s++;
+    } else if (*s == '$') {
+      s = expand_dollar(e, s, end, quoted);
+    } else if (*s == CTLPROC) {
+      s = expand_proc(e, s, end);
+    } else {
+      if (quoted)
+        putlit(e, *s);
+      else
+        putch(e, *s);
+      s++;
+    }
+  }
+}
+
+/* Returns true if a word needs to be expanded before it's used. */
+bool needexp_p(const char *word) {
+  return *word == '~' || strpbrk(word, "$\001\002\003") != NULL ||
+         pattern_p(word);
+}
+
+/* Fields of a command are subject to pathname expansion, but a single word
+ * like name of a file or value of a variable is not. */
+static void initexp(expander_t *e, bool split) {
+  const char *ifs = getvar("IFS");
+  *e = (expander_t){
+    .split = split,
+    .pattern = split,
+    .glob = split,
+    .ifs = ifs ? ifs : " \t\n",
+  };
+}
+
+/* Expand words into a vector of fields. Returns NULL if expansion failed. */
+char **expand_words(token_t *words) {
+  expander_t e;
+  initexp(&e, true);
+
+  for (; *words; words++) {
+    expand(&e, *words, *words + strlen(*words), false);
+    if (e.failed)
+      break;
+    if (e.open)
+      endfield(&e);
+  }
+
+  free(e.buf);
+  if (e.failed) {
+    e.fields = realloc(e.fields, sizeof(char *) * (e.nfields + 1));
+    e.fields[e.nfields] = NULL;
+    freewords(e.fields);
+    return NULL;
+  }
+
+  if (e.fields == NULL)
+    e.fields = malloc(sizeof(char *));
+  e.fields[e.nfields] = NULL;
+  return e.fields;
+}
+
+/* Expand a word into a single string, e.g. name of a file or value of
+ * a variable. Returns NULL if expansion failed. */
+char *expand_word(token_t word) {
+  expander_t e;
+  initexp(&e, false);
+  expand(&e, word, word + strlen(word), false);
+  putch(&e, '\0');
+  if (e.failed) {
+    free(e.buf);
+    return NULL;
+  }
+  return e.buf;
+}
+
+/* Expand values of assignments into "name=value" strings. Returns NULL if
+ * expansion failed. */
+char **expand_assigns(token_t *assigns) {
+  int n = 0;
+  while (assigns[n])
+    n++;
+
+  char **entries = malloc(sizeof(char *) * (n + 1));
+  for (int i = 0; i < n; i++) {
+    char *eq = strchr(assigns[i], '=');
+    char *value = expand_word(eq + 1);
+    if (value == NULL) {
+      entries[i] = NULL;
+      freewords(entries);
+      return NULL;
+    }
+    entries[i] = malloc(eq - assigns[i] + strlen(value) + 2);
+    sprintf(entries[i], "%.*s=%s", (int)(eq - assigns[i]), assigns[i], value);
+    free(value);
+  }
+  entries[n] = NULL;
+  return entries;
+}
+
+void freewords(char **words) {
+  for (char **w = words; *w; w++)
+    free(*w);
+  free(words);
+}
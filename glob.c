@@ -0,0 +1,333 @@
+#include "shell.h"
+#include <dirent.h>
+#include <fnmatch.h>
+
+/* Pathname expansion. Directories are read with getdents into a large buffer
+ * and their listings are cached until the shell runs a command, so patterns
+ * of a command line that refer to the same directory scan it once. Pattern
+ * is matched one path component at a time. Each step is a task that lists
+ * a directory and queues the steps for matching subdirectories. Trees
+ * walked by `**` may be large, so such tasks are shared with a small pool
+ * of threads once there are enough of them. */
+
+#define DIRBUF_SIZE 65536 /* buffer passed to getdents */
+#define DIR_BUCKETS 64    /* must be a power of two */
+#define NWORKERS 3        /* threads helping the shell with `**` */
+#define SPAWN_TASKS 8     /* pending tasks that justify one more thread */
+
+typedef struct entry {
+  char *name;         /* name of directory entry */
+  unsigned char type; /* DT_* type or DT_UNKNOWN */
+} entry_t;
+
+/* Cached listing of a directory. */
+typedef struct dir {
+  struct dir *next; /* next directory in the same bucket */
+  uint32_t hash;    /* hash of the path */
+  char *path;       /* path as it appears in pattern, "" for "." */
+  entry_t *entries; /* entries without "." and ".." */
+  int nentries;     /* number of entries */
+} dir_t;
+
+static dir_t *dirs[DIR_BUCKETS];
+static int ndirs = 0;
+static pthread_mutex_t dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static dir_t *readdirectory(const char *path, uint32_t hash) {
+  dir_t *d = calloc(1, sizeof(dir_t));
+  d->path = strdup(path);
+  d->hash = hash;
+
+  int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return d;
+
+  char *buf = malloc(DIRBUF_SIZE);
+  int size = 0, n;
+  while ((n = Getdents(fd, (struct linux_dirent *)buf, DIRBUF_SIZE)) > 0) {
+    for (int off = 0; off < n;) {
+      struct linux_dirent *de = (struct linux_dirent *)(buf + off);
+      off += de->d_reclen;
+      if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+        continue;
+      if (d->nentries == size) {
+        size = size ? size * 2 : 16;
+        d->entries = realloc(d->entries, sizeof(entry_t) * size);
+      }
+      /* File type is stored in the last byte of the record. */
+      d->entries[d->nentries++] = (entry_t){
+        .name = strdup(de->d_name),
+        .type = *((char *)de + de->d_reclen - 1),
+      };
+    }
+  }
+  free(buf);
+  Close(fd);
+  return d;
+}
+
+/* Returns listing of a directory, reads it if it's not in the cache. */
+static dir_t *getdir(const char *path) {
+  uint32_t hash = jenkins_hash(path, strlen(path), HASHINIT);
+  dir_t **bucket = &dirs[hash & (DIR_BUCKETS - 1)];
+  dir_t *d;
+
+  Pthread_mutex_lock(&dirs_lock);
+  for (d = *bucket; d; d = d->next)
+    if (d->hash == hash && !strcmp(d->path, path))
+      break;
+  Pthread_mutex_unlock(&dirs_lock);
+  if (d)
+    return d;
+
+  d = readdirectory(path, hash);
+  Pthread_mutex_lock(&dirs_lock);
+  d->next = *bucket;
+  *bucket = d;
+  ndirs++;
+  Pthread_mutex_unlock(&dirs_lock);
+  return d;
+}
+
+/* Forget cached listings, as a command may have changed directories. */
+void flushdirs(void) {
+  if (ndirs == 0)
+    return;
+  for (int i = 0; i < DIR_BUCKETS; i++) {
+    while (dirs[i]) {
+      dir_t *d = dirs[i];
+      dirs[i] = d->next;
+      for (int j = 0; j < d->nentries; j++)
+        free(d->entries[j].name);
+      free(d->entries);
+      free(d->path);
+      free(d);
+    }
+  }
+  ndirs = 0;
+}
+
+/* Returns true if pattern contains unescaped `*`, `?` or `[...]`. */
+bool pattern_p(const char *s) {
+  for (; *s; s++) {
+    if (*s == '\\' && s[1])
+      s++;
+    else if (*s == '*' || *s == '?')
+      return true;
+    else if (*s == '[' && strchr(s + 1, ']'))
+      return true;
+  }
+  return false;
+}
+
+/* Remove backslashes that protect characters of a pattern. */
+void unescape_pattern(char *s) {
+  char *w = s;
+  for (; *s; s++) {
+    if (*s == '\\' && s[1])
+      s++;
+    *w++ = *s;
+  }
+  *w = '\0';
+}
+
+/* Directory at `prefix` is to be matched against component `comp`. */
+typedef struct task {
+  char *prefix; /* path ending with '/' or "" */
+  int comp;     /* index of pattern component */
+} task_t;
+
+typedef struct globber {
+  char **comps;         /* components of the pattern */
+  int ncomps;           /* number of components */
+  bool recursive;       /* pattern contains `**` */
+  char **matches;       /* paths found so far */
+  int nmatches;         /* number of paths */
+  int maxmatches;       /* capacity of `matches` */
+  task_t *tasks;        /* stack of pending tasks */
+  int ntasks;           /* number of pending tasks */
+  int maxtasks;         /* capacity of `tasks` */
+  int busy;             /* number of tasks being run */
+  pthread_t workers[NWORKERS];
+  int nworkers;         /* number of threads started */
+  pthread_mutex_t lock; /* protects all of the above */
+  pthread_cond_t cond;  /* signaled when a task is queued or all are done */
+} globber_t;
+
+static void *worker(void *arg);
+
+/* Must be called with `g->lock` held. */
+static void spawn(globber_t *g) {
+  sigset_t all, mask;
+  sigfillset(&all);
+  /* Signals must be handled by the main thread only. */
+  pthread_sigmask(SIG_SETMASK, &all, &mask);
+  Pthread_create(&g->workers[g->nworkers++], NULL, worker, g);
+  pthread_sigmask(SIG_SETMASK, &mask, NULL);
+}
+
+static void pushtask(globber_t *g, char *prefix, int comp) {
+  Pthread_mutex_lock(&g->lock);
+  if (g->ntasks == g->maxtasks) {
+    g->maxtasks = g->maxtasks ? g->maxtasks * 2 : 16;
+    g->tasks = realloc(g->tasks, sizeof(task_t) * g->maxtasks);
+  }
+  g->tasks[g->ntasks++] = (task_t){prefix, comp};
+  if (g->recursive && g->nworkers < NWORKERS &&
+      g->ntasks > SPAWN_TASKS * (g->nworkers + 1))
+    spawn(g);
+  Pthread_cond_signal(&g->cond);
+  Pthread_mutex_unlock(&g->lock);
+}
+
+static void addmatch(globber_t *g, char *path) {
+  Pthread_mutex_lock(&g->lock);
+  if (g->nmatches + 1 >= g->maxmatches) {
+    g->maxmatches = g->maxmatches ? g->maxmatches * 2 : 16;
+    g->matches = realloc(g->matches, sizeof(char *) * g->maxmatches);
+  }
+  g->matches[g->nmatches++] = path;
+  Pthread_mutex_unlock(&g->lock);
+}
+
+static char *mkpath(const char *prefix, const char *name, const char *suffix) {
+  char *path = malloc(strlen(prefix) + strlen(name) + strlen(suffix) + 1);
+  stpcpy(stpcpy(stpcpy(path, prefix), name), suffix);
+  return path;
+}
+
+/* Symbolic links are followed unless `**` is walking the tree. */
+static bool isdir(const char *prefix, entry_t *e, bool follow) {
+  if (e->type != DT_UNKNOWN && (e->type != DT_LNK || !follow))
+    return e->type == DT_DIR;
+  struct stat sb;
+  char *path = mkpath(prefix, e->name, "");
+  int rc = follow ? stat(path, &sb) : lstat(path, &sb);
+  free(path);
+  return rc == 0 && S_ISDIR(sb.st_mode);
+}
+
+static void runtask(globber_t *g, task_t *t) {
+  const char *comp = g->comps[t->comp];
+  bool last = (t->comp == g->ncomps - 1);
+
+  if (!pattern_p(comp)) {
+    char *name = strdup(comp);
+    unescape_pattern(name);
+    char *path = mkpath(t->prefix, name, last ? "" : "/");
+    struct stat sb;
+    if (!last)
+      pushtask(g, path, t->comp + 1);
+    else if (lstat(path, &sb) == 0)
+      addmatch(g, path);
+    else
+      free(path);
+    free(name);
+    return;
+  }
+
+  dir_t *d = getdir(t->prefix);
+
+  if (!strcmp(comp, "**")) {
+    /* Matches any number of directories, that are not hidden. */
+    if (!last)
+      pushtask(g, strdup(t->prefix), t->comp + 1);
+    for (int i = 0; i < d->nentries; i++) {
+      entry_t *e = &d->entries[i];
+      if (e->name[0] == '.')
+        continue;
+      if (last)
+        addmatch(g, mkpath(t->prefix, e->name, ""));
+      if (isdir(t->prefix, e, false))
+        pushtask(g, mkpath(t->prefix, e->name, "/"), t->comp);
+    }
+    return;
+  }
+
+  for (int i = 0; i < d->nentries; i++) {
+    entry_t *e = &d->entries[i];
+    if (fnmatch(comp, e->name, FNM_PERIOD))
+      continue;
+    if (last)
+      addmatch(g, mkpath(t->prefix, e->name, ""));
+    else if (isdir(t->prefix, e, true))
+      pushtask(g, mkpath(t->prefix, e->name, "/"), t->comp + 1);
+  }
+}
+
+/* Run tasks until there are none left and no task is running. */
+static void *worker(void *arg) {
+  globber_t *g = arg;
+
+  Pthread_mutex_lock(&g->lock);
+  while (true) {
+    while (g->ntasks == 0 && g->busy > 0)
+      Pthread_cond_wait(&g->cond, &g->lock);
+    if (g->ntasks == 0)
+      break;
+    task_t t = g->tasks[--g->ntasks];
+    g->busy++;
+    Pthread_mutex_unlock(&g->lock);
+    runtask(g, &t);
+    free(t.prefix);
+    Pthread_mutex_lock(&g->lock);
+    if (--g->busy == 0 && g->ntasks == 0)
+      Pthread_cond_broadcast(&g->cond);
+  }
+  Pthread_mutex_unlock(&g->lock);
+  return NULL;
+}
+
+static int pathcmp(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+/* Find paths matching a pattern, in which quoted characters are escaped with
+ * backslashes. Stores sorted NULL-terminated vector of paths into `*pathsp`
+ * and returns their number. */
+int globpath(const char *pattern, char ***pathsp) {
+  globber_t g = {};
+  char *copy = strdup(pattern);
+  char *prefix = "";
+
+  if (*copy == '/')
+    prefix = "/";
+
+  /* Split pattern into components, empty ones are kept. */
+  int n = 1;
+  for (char *s = copy; *s; s++)
+    n += (*s == '/');
+  char *comps[n];
+  char *s = copy + (*copy == '/');
+  g.comps = comps;
+  while (true) {
+    comps[g.ncomps++] = s;
+    if (!(s = strchr(s, '/')))
+      break;
+    *s++ = '\0';
+  }
+  for (int i = 0; i < g.ncomps; i++)
+    g.recursive |= !strcmp(comps[i], "**");
+
+  Pthread_mutex_init(&g.lock, NULL);
+  Pthread_cond_init(&g.cond, NULL);
+  pushtask(&g, strdup(prefix), 0);
+  worker(&g);
+  for (int i = 0; i < g.nworkers; i++)
+    Pthread_join(g.workers[i], NULL);
+  Pthread_cond_destroy(&g.cond);
+  Pthread_mutex_destroy(&g.lock);
+
+  free(g.tasks);
+  free(copy);
+
+  if (g.nmatches == 0) {
+    free(g.matches);
+    *pathsp = NULL;
+    return 0;
+  }
+  qsort(g.matches, g.nmatches, sizeof(char *), pathcmp);
+  g.matches[g.nmatches] = NULL;
+  *pathsp = g.matches;
+  return g.nmatches;
+}
@@ -19,14 +19,25 @@ static job_t *jobs = NULL;          /* array of all jobs */
 static int njobmax = 1;             /* number of slots in jobs array */
 static int tty_fd = -1;             /* controlling terminal file descriptor */
 static struct termios shell_tmodes; /* saved shell terminal modes */
+static pid_t shell_pgid;            /* process group of the shell */
 
-static void sigchld_handler(int sig) {
-  int old_errno = errno;
-  pid_t pid;
-  int status;
-  /* TODO: Change state (FINISHED, RUNNING, STOPPED) of processes and jobs.
-   * Bury all children that finished saving their status in jobs. */
-#ifdef STUDENT
+/* Terminal handover is tracked, so that tcsetpgrp and tcsetattr are issued
+ * only if they change something. Modes are known unless a job was given
+ * the terminal, since it may have changed them. */
+static pid_t tty_pgrp;             /* foreground process group */
+static struct termios tty_tmodes;  /* modes currently set on the terminal */
+static bool tty_known;             /* true if `tty_tmodes` are up to date */
+
+bool jobctl = false;
+
+/* Builtins in pipelines may run on threads of the shell. Each is accounted
+ * as a pseudo-process with a negative identifier, which is never passed to
+ * kill or waitpid. Threads are created and reaped by the main thread only. */
+static thread_t *threads = NULL; /* list of threads, including reaped ones */
+static pid_t lastthread = 0;     /* identifier of the most recent thread */
+
+/* Record new status of process `pid` and update the state of its job. */
+static void setprocstate(pid_t pid, int status) {
   /* newstate trzyma nowy stan procesu zwróconego przez waitpid, trzy flagi
   is_job służą do sprawdzenia czy trzeba zmienic status całego zadania*/
   int newstate = -1;
@@ -37,61 +48,83 @@ static void sigchld_handler(int sig) {
     if (jobs[j].pgid == 0) {
       continue;
     }
-    /*Wrapper do Waitpid ma jeden problem, mianowice dla ECHILD (oznacza że
-    rodzic nie ma dzieci na które może czekać) kończy shella z błędem co jest
-    niepotrzebne bo możemy po prostu wtedy zakończyć handler gdyż nie jest to
-    błąd z którym nie możemy
-    sobie poradzić (jest to nawet coś czego oczekujemy jeżeli przykładowo
-    odpalimy tylko jeden proces pierwszoplanoyw)*/
-    while ((pid = waitpid(-jobs[j].pgid, &status,
-                          WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-
-      if (WIFEXITED(status) || WIFSIGNALED(status)) {
-        newstate = FINISHED;
-      } else if (WIFSTOPPED(status)) {
-        newstate = STOPPED;
-      } else if (WIFCONTINUED(status)) {
-        newstate = RUNNING;
-      }
-      is_job_finished = 1;
-      is_job_stopped = 1;
-      is_job_running = 1;
-      /*Przechodzimy po całym zadaniu, aktualizujemy flagi i stan, oraz exitcode
-       * procesu*/
-      for (int i = 0; i < jobs[j].nproc; i++) {
-        if (jobs[j].proc[i].pid == pid) {
-          jobs[j].proc[i].state = newstate;
-          jobs[j].proc[i].exitcode = status;
-        }
-        if (jobs[j].proc[i].state == FINISHED) {
-          is_job_stopped = 0;
-          is_job_running = 0;
-        }
-        if (jobs[j].proc[i].state == RUNNING) {
-          is_job_stopped = 0;
-          is_job_finished = 0;
-        }
-        if (jobs[j].proc[i].state == STOPPED) {
-          is_job_finished = 0;
-          is_job_running = 0;
-        }
+
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      newstate = FINISHED;
+    } else if (WIFSTOPPED(status)) {
+      newstate = STOPPED;
+    } else if (WIFCONTINUED(status)) {
+      newstate = RUNNING;
+    }
+    is_job_finished = 1;
+    is_job_stopped = 1;
+    is_job_running = 1;
+    /*Przechodzimy po całym zadaniu, aktualizujemy flagi i stan, oraz exitcode
+     * procesu*/
+    for (int i = 0; i < jobs[j].nproc; i++) {
+      if (jobs[j].proc[i].pid == pid) {
+        jobs[j].proc[i].state = newstate;
+        jobs[j].proc[i].exitcode = status;
       }
-      if (is_job_stopped && jobs[j].state != STOPPED) {
-        jobs[j].state = STOPPED;
+      if (jobs[j].proc[i].state == FINISHED) {
+        is_job_stopped = 0;
+        is_job_running = 0;
       }
-      if (is_job_running && jobs[j].state != RUNNING) {
-        jobs[j].state = RUNNING;
+      if (jobs[j].proc[i].state == RUNNING) {
+        is_job_stopped = 0;
+        is_job_finished = 0;
       }
-      if (is_job_finished && jobs[j].state != FINISHED) {
-        jobs[j].state = FINISHED;
+      if (jobs[j].proc[i].state == STOPPED) {
+        is_job_finished = 0;
+        is_job_running = 0;
       }
     }
-    /*Jeżeli dostaniemy inny error niż ECHILD to chcemy zakończyć program z
-     * błędem*/
-    if (pid == -1 && errno != 10) {
-      unix_error("Waitpid error");
+    if (is_job_stopped && jobs[j].state != STOPPED) {
+      jobs[j].state = STOPPED;
+    }
+    if (is_job_running && jobs[j].state != RUNNING) {
+      jobs[j].state = RUNNING;
+    }
+    if (is_job_finished && jobs[j].state != FINISHED) {
+      jobs[j].state = FINISHED;
+    }
+  }
+}
+
+/* Threads that finished are reaped like children. Records are freed later
+ * by `addthread`, since the handler must not call free. */
+static void reapthreads(void) {
+  for (thread_t *t = threads; t; t = t->next) {
+    if (!t->reaped && atomic_load(&t->done)) {
+      t->reaped = true;
+      setprocstate(t->pid, t->status);
     }
   }
+}
+
+static void sigchld_handler(int sig) {
+  int old_errno = errno;
+  pid_t pid;
+  int status;
+  /* TODO: Change state (FINISHED, RUNNING, STOPPED) of processes and jobs.
+   * Bury all children that finished saving their status in jobs. */
+#ifdef STUDENT
+  /*Wrapper do Waitpid ma jeden problem, mianowice dla ECHILD (oznacza że
+  rodzic nie ma dzieci na które może czekać) kończy shella z błędem co jest
+  niepotrzebne bo możemy po prostu wtedy zakończyć handler gdyż nie jest to
+  błąd z którym nie możemy
+  sobie poradzić (jest to nawet coś czego oczekujemy jeżeli przykładowo
+  odpalimy tylko jeden proces pierwszoplanoyw)*/
+  /* Without job control all jobs share shell's process group, so we cannot
+   * wait for a particular group. Find the job by process id instead. */
+  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0)
+    setprocstate(pid, status);
+  /*Jeżeli dostaniemy inny error niż ECHILD to chcemy zakończyć program z
+   * błędem*/
+  if (pid == -1 && errno != ECHILD) {
+    unix_error("Waitpid error");
+  }
+  reapthreads();
 #endif /* !STUDENT */
   errno = old_errno;
 }
@@ -148,16 +181,45 @@ static void movejob(int from, int to) {
   memset(&jobs[from], 0, sizeof(job_t));
 }
 
+/* Stages made of assignments or compound commands have no words. */
 static void mkcommand(char **cmdp, char **argv) {
-  if (*cmdp)
-    strapp(cmdp, " | ");
+  strapp(cmdp, *cmdp ? " | " : "");
 
-  for (strapp(cmdp, *argv++); *argv; argv++) {
-    strapp(cmdp, " ");
-    strapp(cmdp, *argv);
+  for (char **arg = argv; *arg; arg++) {
+    if (arg != argv)
+      strapp(cmdp, " ");
+    strapp(cmdp, *arg);
   }
 }
 
+/* Registers a thread that is about to run a builtin. Called with SIGCHLD
+ * blocked, so records of reaped threads can be freed here. */
+thread_t *addthread(void) {
+  for (thread_t **tp = &threads; *tp;) {
+    thread_t *t = *tp;
+    if (t->reaped) {
+      *tp = t->next;
+      free(t);
+    } else {
+      tp = &t->next;
+    }
+  }
+
+  thread_t *t = calloc(1, sizeof(thread_t));
+  t->pid = --lastthread;
+  t->next = threads;
+  threads = t;
+  return t;
+}
+
+/* Called by a thread as the last thing it does with its record. Shell gets
+ * notified with SIGCHLD, which is always handled by the main thread. */
+void exitthread(thread_t *t, int status) {
+  t->status = status;
+  atomic_store(&t->done, true);
+  Kill(getpid(), SIGCHLD);
+}
+
 void addproc(int j, pid_t pid, char **argv) {
   assert(j < njobmax);
   job_t *job = &jobs[j];
@@ -168,7 +230,8 @@ void addproc(int j, pid_t pid, char **argv) {
   proc->pid = pid;
   proc->state = RUNNING;
   proc->exitcode = -1;
-  mkcommand(&job->command, argv);
+  if (argv)
+    mkcommand(&job->command, argv);
 }
 
 /* Returns job's state.
@@ -196,6 +259,31 @@ char *jobcmd(int j) {
   return job->command;
 }
 
+/* Returns current modes of the terminal, reading them if they're unknown. */
+static const struct termios *curtmodes(void) {
+  if (!tty_known) {
+    Tcgetattr(tty_fd, &tty_tmodes);
+    tty_known = true;
+  }
+  return &tty_tmodes;
+}
+
+static bool sametmodes(const struct termios *a, const struct termios *b) {
+  return a->c_iflag == b->c_iflag && a->c_oflag == b->c_oflag &&
+         a->c_cflag == b->c_cflag && a->c_lflag == b->c_lflag &&
+         !memcmp(a->c_cc, b->c_cc, sizeof(a->c_cc)) &&
+         cfgetispeed(a) == cfgetispeed(b) && cfgetospeed(a) == cfgetospeed(b);
+}
+
+/* Sets terminal modes unless they're in effect already. Output is drained
+ * before the change, but unlike TCSAFLUSH input typed ahead is kept. */
+static void settmodes(const struct termios *tmodes) {
+  if (sametmodes(tmodes, curtmodes()))
+    return;
+  Tcsetattr(tty_fd, TCSADRAIN, tmodes);
+  tty_tmodes = *tmodes;
+}
+
 /* Continues a job that has been stopped. If move to foreground was requested,
  * then move the job to foreground and start monitoring it. */
 bool resumejob(int j, int bg, sigset_t *mask) {
@@ -204,7 +292,7 @@ bool resumejob(int j, int bg, sigset_t *mask) {
       continue;
   }
 
-  if (j >= njobmax || jobs[j].state == FINISHED)
+  if (j >= njobmax || jobs[j].state == FINISHED || !jobctl)
     return false;
 
     /* TODO: Continue stopped job. Possibly move job to foreground slot. */
@@ -213,14 +301,14 @@ bool resumejob(int j, int bg, sigset_t *mask) {
    * zaraz po SIGCONT nie dostał sygnału który go zatrzyma*/
   if (!bg) {
     /*Przywracamy ustawienia terminala*/
+    settmodes(&jobs[j].tmodes);
     setfgpgrp(jobs[j].pgid);
-    Tcsetattr(tty_fd, TCSAFLUSH, &jobs[j].tmodes);
   }
   Kill(-jobs[j].pgid, SIGCONT);
   printf("continue '%s'\n", jobcmd(j));
   if (!bg) {
     movejob(j, 0);
-    while (jobs[0].state != RUNNING) {
+    while (jobs[0].state == STOPPED) {
       /*Czekamy aż zadanie stanie się running*/
       Sigsuspend(mask);
     }
@@ -237,6 +325,14 @@ bool killjob(int j) {
     return false;
   debug("[%d] killing '%s'\n", j, jobs[j].command);
 
+  /* Without job control processes share our process group. */
+  if (!jobctl) {
+    for (int i = 0; i < jobs[j].nproc; i++)
+      if (jobs[j].proc[i].state != FINISHED && jobs[j].proc[i].pid > 0)
+        Kill(jobs[j].proc[i].pid, SIGTERM);
+    return true;
+  }
+
   /* TODO: I love the smell of napalm in the morning. */
 #ifdef STUDENT
   // Wysyłamy SIGTERM do zadania,jeżeli było ono zatrzymane musimy jeszcze
@@ -258,6 +354,13 @@ void watchjobs(int which) {
     if (jobs[j].pgid == 0)
       continue;
 
+    /* Non-interactive shell reaps finished jobs silently. */
+    if (!jobctl) {
+      if (jobs[j].state == FINISHED)
+        deljob(&jobs[j]);
+      continue;
+    }
+
       /* TODO: Report job number, state, command and exit code or signal. */
 #ifdef STUDENT
     /*Sprawdzamy stan zadań i używamy makr żeby z pola status dostać kod
@@ -286,11 +389,28 @@ void watchjobs(int which) {
   }
 }
 
+/* Translate wait status into exit code as reported by `$?`. */
+static int waitcode(int status) {
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  if (WIFSTOPPED(status))
+    return 128 + WSTOPSIG(status);
+  return 0;
+}
+
 /* Monitor job execution. If it gets stopped move it to background.
  * When a job has finished or has been stopped move shell to foreground. */
 int monitorjob(sigset_t *mask) {
   int exitcode = 0, state;
 
+  if (!jobctl) {
+    while ((state = jobstate(0, &exitcode)) == RUNNING)
+      Sigsuspend(mask);
+    return waitcode(exitcode);
+  }
+
   /* TODO: Following code requires use of Tcsetpgrp of tty_fd. */
 #ifdef STUDENT
   state = RUNNING;
@@ -302,18 +422,27 @@ int monitorjob(sigset_t *mask) {
   /*Jeżeli proces został zatrzymany to zapisujemy jego ustawienia terminala i
    * przesuwamy go na wolną pozycję*/
   if (state == STOPPED) {
-    Tcgetattr(tty_fd, &jobs[0].tmodes);
+    jobs[0].tmodes = *curtmodes();
     movejob(0, allocjob());
   }
-  setfgpgrp(getpgid(getpid()));
-  Tcsetattr(tty_fd, TCSAFLUSH, &shell_tmodes);
+  setfgpgrp(shell_pgid);
+  settmodes(&shell_tmodes);
 #endif /* !STUDENT */
 
-  return exitcode;
+  return waitcode(exitcode);
+}
+
+/* Wait for job `j` led by `pgid` without job control and forget it. The job
+ * may have been reaped meanwhile by `watchjobs` and its slot reused. */
+void waitjob(int j, pid_t pgid, sigset_t *mask) {
+  int exitcode;
+  while (jobs[j].pgid == pgid && jobstate(j, &exitcode) == RUNNING)
+    Sigsuspend(mask);
 }
 
-/* Called just at the beginning of shell's life. */
-void initjobs(void) {
+/* Called just at the beginning of shell's life. Job control is enabled only
+ * for interactive shells. */
+void initjobs(bool interactive) {
   struct sigaction act = {
     .sa_flags = SA_RESTART,
     .sa_handler = sigchld_handler,
@@ -327,17 +456,53 @@ void initjobs(void) {
 
   jobs = calloc(sizeof(job_t), 1);
 
+  jobctl = interactive;
+  if (!jobctl)
+    return;
+
   /* Assume we're running in interactive mode, so move us to foreground.
    * Duplicate terminal fd, but do not leak it to subprocesses that execve. */
   assert(isatty(STDIN_FILENO));
-  tty_fd = Dup(STDIN_FILENO);
-  fcntl(tty_fd, F_SETFD, FD_CLOEXEC);
+  if ((tty_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0)) < 0)
+    unix_error("fcntl error");
 
   /* Take control of the terminal. */
-  Tcsetpgrp(tty_fd, getpgrp());
+  shell_pgid = getpgrp();
+  Tcsetpgrp(tty_fd, shell_pgid);
+  tty_pgrp = shell_pgid;
 
   /* Save default terminal attributes for the shell. */
-  Tcgetattr(tty_fd, &shell_tmodes);
+  shell_tmodes = *curtmodes();
+}
+
+/* Called in a forked child that evaluates a subshell or compound command.
+ * It neither owns the terminal nor inherits jobs of its parent. */
+void initsubshell(void) {
+  for (int j = 0; j < njobmax; j++) {
+    free(jobs[j].command);
+    free(jobs[j].proc);
+  }
+  memset(jobs, 0, sizeof(job_t) * njobmax);
+
+  /* Threads of the parent were not copied. */
+  while (threads) {
+    thread_t *t = threads;
+    threads = t->next;
+    free(t);
+  }
+
+  if (jobctl) {
+    /* Descriptor is closed along with others by `applyplan`. */
+    tty_fd = -1;
+    jobctl = false;
+  }
+}
+
+/* Threads die with the shell, so let them finish writing their output. */
+static void waitthreads(sigset_t *mask) {
+  for (thread_t *t = threads; t; t = t->next)
+    while (!atomic_load(&t->done))
+      Sigsuspend(mask);
 }
 
 /* Called just before the shell finishes. */
@@ -345,6 +510,13 @@ void shutdownjobs(void) {
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
 
+  if (!jobctl) {
+    waitthreads(&mask);
+    watchjobs(FINISHED);
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    return;
+  }
+
   /* TODO: Kill remaining jobs and wait for them to finish. */
 #ifdef STUDENT
   int status = 0;
@@ -372,6 +544,7 @@ void shutdownjobs(void) {
   }
 #endif /* !STUDENT */
 
+  waitthreads(&mask);
   watchjobs(FINISHED);
 
   Sigprocmask(SIG_SETMASK, &mask, NULL);
@@ -379,7 +552,80 @@ void shutdownjobs(void) {
   Close(tty_fd);
 }
 
-/* Sets foreground process group to `pgid`. */
+/* Descriptor `fd` is to be taken over by `exec`. If the shell uses it for
+ * the terminal, the terminal is moved to another descriptor. */
+void releasefd(int fd) {
+  if (tty_fd < 0 || tty_fd != fd)
+    return;
+  int newfd = fcntl(tty_fd, F_DUPFD_CLOEXEC, 10);
+  if (newfd < 0)
+    unix_error("fcntl error");
+  Close(tty_fd);
+  tty_fd = newfd;
+}
+
+/* Processes of a foreground job must not run before the job is given the
+ * terminal. They wait for end of file on a pipe, whose write end the shell
+ * closes after the handover, which releases all of them at once. */
+void initbarrier(int barrier[2], bool fg) {
+  barrier[0] = barrier[1] = -1;
+  if (jobctl && fg)
+    mkpipe(&barrier[0], &barrier[1], 0);
+}
+
+/* Called by a process of the job just after fork. The shell moves processes
+ * of a foreground job into process group `pgid` before it releases them, so
+ * only background jobs join the group by themselves. Read end of the barrier
+ * is closed later along with other descriptors by `applyplan` or execve. */
+void waitbarrier(int barrier[2], pid_t pgid) {
+  char c;
+  if (barrier[0] < 0) {
+    joinpgrp(0, pgid);
+    return;
+  }
+  Close(barrier[1]);
+  while (read(barrier[0], &c, 1) < 0 && errno == EINTR)
+    continue;
+}
+
+/* Called by the shell once the job was moved to foreground. */
+void releasebarrier(int barrier[2]) {
+  if (barrier[0] < 0)
+    return;
+  Close(barrier[1]);
+  Close(barrier[0]);
+}
+
+/* Moves process `pid` (0 for the caller) into process group `pgid` (0 for
+ * a new group led by the process). Both the shell and the child do it, so the
+ * child may have already executed a program, which makes setpgid fail. */
+void joinpgrp(pid_t pid, pid_t pgid) {
+  if (jobctl && setpgid(pid, pgid) < 0 && errno != EACCES)
+    unix_error("Setpgid error");
+}
+
+/* Called by a process of a job before it runs a command. Signals ignored by
+ * an interactive shell get back their default dispositions, while background
+ * jobs started without job control must not be interrupted. */
+void resetsignals(bool bg) {
+  if (jobctl) {
+    /* Do not lose SIGINT delivered before execve replaces our handler. */
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    Signal(SIGTTIN, SIG_DFL);
+    Signal(SIGTTOU, SIG_DFL);
+  } else if (bg) {
+    Signal(SIGINT, SIG_IGN);
+  }
+}
+
+/* Sets foreground process group to `pgid`. Once a job gets the terminal,
+ * its modes are no longer known. */
 void setfgpgrp(pid_t pgid) {
+  if (tty_fd < 0 || pgid == tty_pgrp)
+    return;
   Tcsetpgrp(tty_fd, pgid);
+  tty_pgrp = pgid;
+  if (pgid != shell_pgid)
+    tty_known = false;
 }
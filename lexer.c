@@ -12,29 +12,337 @@ void strapp(char **dstp, const char *src) {
   }
 }
 
-token_t *tokenize(char *s, int *tokc_p) {
+#define SEPARATORS " \t\n|&<>;()"
+
+/* Quoted characters that would be special to the expansion stage. */
+#define SPECIAL "\001\002$\\*?[]}~"
+
+/* Here-document, whose body begins on the line after the operator. */
+typedef struct heredoc {
+  int slot;       /* token that will point to the body */
+  char *delim;    /* delimiter with quotes removed */
+  bool quoted;    /* delimiter was quoted, so body is taken literally */
+  bool striptabs; /* `<<-` removes leading tabs from lines of body */
+} heredoc_t;
+
+/* Output of a lexer is a sequence of NUL-terminated words. */
+typedef struct lexer {
+  const char *s;       /* next character of input text */
+  char *w;             /* where next character of a word goes */
+  bool incomplete;     /* text ended within quotes or a parameter */
+  heredoc_t *heredocs; /* here-documents waiting for end of line */
+  int nheredocs;       /* number of waiting here-documents */
+} lexer_t;
+
+static void scanword(lexer_t *lx, const char *stop);
+
+/* Copy a quoted character protecting it from expansion. */
+static void putquoted(lexer_t *lx, char c) {
+  if (strchr(SPECIAL, c))
+    *lx->w++ = CTLESC;
+  *lx->w++ = c;
+}
+
+/* Find `)` that closes command substitution, which starts at `s` just after
+ * `$(`. Quotes and nested parentheses are skipped. Returns pointer to the
+ * parenthesis or to the end of text if it's missing. */
+const char *skipcmd(const char *s) {
+  for (int depth = 0; *s; s++) {
+    if (*s == '\\' && s[1]) {
+      s++;
+    } else if (*s == '\'') {
+      const char *q = strchr(s + 1, '\'');
+      if (q == NULL)
+        return s + strlen(s);
+      s = q;
+    } else if (*s == '"') {
+      for (s++; *s && *s != '"'; s++)
+        if (*s == '\\' && s[1])
+          s++;
+      if (*s == '\0')
+        return s;
+    } else if (*s == '(') {
+      depth++;
+    } else if (*s == ')' && depth-- == 0) {
+      return s;
+    }
+  }
+  return s;
+}
+
+/* Copy expansion introduced by '$' verbatim. Blanks and operators within
+ * `${...}`, `$((...))` and `$(...)` do not end a word. Text of a command
+ * substitution is kept as it is, since it's parsed when it's expanded. */
+static void scandollar(lexer_t *lx) {
+  const char *s = lx->s;
+
+  if (s[1] == '(' && s[2] != '(') {
+    const char *end = skipcmd(s + 2);
+    if (*end != ')') {
+      lx->incomplete = true;
+      lx->s = end;
+      return;
+    }
+    memcpy(lx->w, s, end + 1 - s);
+    lx->w += end + 1 - s;
+    lx->s = end + 1;
+  } else if (s[1] == '{') {
+    lx->w = stpcpy(lx->w, "${");
+    lx->s += 2;
+    scanword(lx, "}");
+    if (*lx->s != '}') {
+      lx->incomplete = true;
+      return;
+    }
+    *lx->w++ = *lx->s++;
+  } else if (s[1] == '(' && s[2] == '(') {
+    lx->w = stpcpy(lx->w, "$((");
+    lx->s += 3;
+    for (int depth = 0;;) {
+      scanword(lx, "()");
+      if (*lx->s == '\0') {
+        lx->incomplete = true;
+        return;
+      }
+      if (*lx->s == '(') {
+        depth++;
+      } else if (depth > 0) {
+        depth--;
+      } else if (lx->s[1] == ')') {
+        lx->w = stpcpy(lx->w, "))");
+        lx->s += 2;
+        return;
+      }
+      *lx->w++ = *lx->s++;
+    }
+  } else {
+    *lx->w++ = *lx->s++;
+  }
+}
+
+/* Process substitution begins a word with `<(` or `>(`. */
+static bool procsubst_p(const char *s) {
+  return (s[0] == '<' || s[0] == '>') && s[1] == '(';
+}
+
+/* Copy process substitution verbatim after CTLPROC, which tells it apart
+ * from quoted text. Command is parsed when it's expanded. */
+static void scanprocsubst(lexer_t *lx) {
+  const char *end = skipcmd(lx->s + 2);
+  if (*end != ')') {
+    lx->incomplete = true;
+    lx->s = end;
+    return;
+  }
+  *lx->w++ = CTLPROC;
+  memcpy(lx->w, lx->s, end + 1 - lx->s);
+  lx->w += end + 1 - lx->s;
+  lx->s = end + 1;
+}
+
+/* Turn `cmd` into $(cmd). Backslash keeps its meaning only before '$', '`',
+ * '\' and, if backquotes appear within double quotes, before '"'. */
+static void scanbackquote(lexer_t *lx, bool dquoted) {
+  const char *escaped = dquoted ? "$`\\\"" : "$`\\";
+
+  lx->w = stpcpy(lx->w, "$(");
+  for (lx->s++; *lx->s && *lx->s != '`'; lx->s++) {
+    if (lx->s[0] == '\\' && lx->s[1] && strchr(escaped, lx->s[1]))
+      lx->s++;
+    *lx->w++ = *lx->s;
+  }
+  if (*lx->s == '\0') {
+    lx->incomplete = true;
+    return;
+  }
+  *lx->w++ = ')';
+  lx->s++;
+}
+
+/* Scan a word or a part of it until a character from `stop` that is
+ * neither quoted nor nested. Quotes and backslashes are removed and the
+ * characters they protect are escaped with CTLESC. Double quotes are
+ * replaced with CTLQUOTE, as they affect field splitting. */
+static void scanword(lexer_t *lx, const char *stop) {
+  while (*lx->s && !strchr(stop, *lx->s)) {
+    char c = *lx->s;
+
+    if (c == '\'') {
+      for (lx->s++; *lx->s && *lx->s != '\''; lx->s++)
+        putquoted(lx, *lx->s);
+      if (*lx->s == '\0') {
+        lx->incomplete = true;
+        return;
+      }
+      lx->s++;
+    } else if (c == '"') {
+      *lx->w++ = CTLQUOTE;
+      for (lx->s++; *lx->s && *lx->s != '"';) {
+        if (*lx->s == '$') {
+          scandollar(lx);
+        } else if (*lx->s == '`') {
+          scanbackquote(lx, true);
+        } else if (lx->s[0] == '\\' && lx->s[1] &&
+                   strchr("\"\\$`\n", lx->s[1])) {
+          if (lx->s[1] != '\n')
+            putquoted(lx, lx->s[1]);
+          lx->s += 2;
+        } else {
+          putquoted(lx, *lx->s++);
+        }
+      }
+      if (*lx->s == '\0') {
+        lx->incomplete = true;
+        return;
+      }
+      *lx->w++ = CTLQUOTE;
+      lx->s++;
+    } else if (c == '\\' && lx->s[1]) {
+      /* Backslash followed by newline joins lines. */
+      if (lx->s[1] == '\n') {
+        if (lx->s[2] == '\0')
+          lx->incomplete = true;
+      } else {
+        putquoted(lx, lx->s[1]);
+      }
+      lx->s += 2;
+    } else if (c == '$') {
+      scandollar(lx);
+    } else if (c == '`') {
+      scanbackquote(lx, false);
+    } else {
+      *lx->w++ = *lx->s++;
+    }
+  }
+}
+
+/* Scan delimiter of a here-document and reserve a token for its body. */
+static void scandelim(lexer_t *lx, token_t *tokvec, int *ntoksp) {
+  heredoc_t h = {.striptabs = (*lx->s == '-')};
+
+  if (h.striptabs)
+    lx->s++;
+  while (*lx->s == ' ' || *lx->s == '\t')
+    lx->s++;
+  if (*lx->s == '\0' || strchr(SEPARATORS, *lx->s))
+    return;
+
+  const char *start = lx->s;
+  h.delim = lx->w;
+  scanword(lx, SEPARATORS);
+  *lx->w++ = '\0';
+  for (const char *s = start; s < lx->s && !h.quoted; s++)
+    h.quoted = (*s == '\'' || *s == '"' || *s == '\\');
+
+  /* Delimiter is compared with lines of body as it is. */
+  char *w = h.delim;
+  for (char *s = h.delim; *s; s++)
+    if (*s != CTLESC && *s != CTLQUOTE)
+      *w++ = *s;
+  *w = '\0';
+
+  h.slot = (*ntoksp)++;
+  tokvec[h.slot] = h.delim;
+  lx->heredocs = realloc(lx->heredocs, sizeof(heredoc_t) * (lx->nheredocs + 1));
+  lx->heredocs[lx->nheredocs++] = h;
+}
+
+/* Copy lines of a here-document up to the delimiter. Unless delimiter was
+ * quoted, body undergoes expansions as if it were in double quotes. */
+static void scanbody(lexer_t *lx, heredoc_t *h) {
+  size_t len = strlen(h->delim);
+
+  while (true) {
+    if (*lx->s == '\0') {
+      lx->incomplete = true;
+      return;
+    }
+    if (h->striptabs)
+      while (*lx->s == '\t')
+        lx->s++;
+    const char *eol = strchrnul(lx->s, '\n');
+    const char *end = *eol ? eol + 1 : eol;
+    if (eol - lx->s == len && !strncmp(lx->s, h->delim, len)) {
+      lx->s = end;
+      return;
+    }
+    while (lx->s < end) {
+      if (h->quoted) {
+        putquoted(lx, *lx->s++);
+      } else if (lx->s[0] == '\\' && lx->s[1] &&
+                 strchr("$`\\\n", lx->s[1])) {
+        if (lx->s[1] != '\n')
+          putquoted(lx, lx->s[1]);
+        lx->s += 2;
+      } else if (*lx->s == '$') {
+        scandollar(lx);
+      } else if (*lx->s == '`') {
+        scanbackquote(lx, true);
+      } else {
+        putquoted(lx, *lx->s++);
+      }
+    }
+  }
+}
+
+/* Double quotes matter only to expansions. Remove them from other words,
+ * so these don't need to be processed before each use. */
+static void simplify(char *word) {
+  if (strchr(word, '$') || strchr(word, CTLESC))
+    return;
+  char *w = word;
+  for (char *s = word; *s; s++)
+    if (*s != CTLQUOTE)
+      *w++ = *s;
+  *w = '\0';
+}
+
+/* Split text into words and operators. Words are stored into `buf` that
+ * must be able to hold `2 * strlen(text) + 2` characters. If text ends within
+ * quotes then `*incompletep` is set, as the word continues on the next line. */
+token_t *tokenize(const char *text, char *buf, int *tokc_p,
+                  bool *incompletep) {
   int capacity = 10;
   int ntoks = 0;
+  lexer_t lx = {.s = text, .w = buf};
+  const char *s;
 
   token_t *tokvec = malloc(sizeof(token_t) * (capacity + 1));
 
-  while (*s != 0) {
-    /* Consume whitespace characters. */
-    if (isspace(*s)) {
-      *s++ = 0;
+  while (*(s = lx.s) != 0) {
+    /* Consume whitespace characters, but newline separates commands. */
+    if (isspace(*s) && *s != '\n') {
+      lx.s++;
+      continue;
+    }
+
+    /* Comments extend to the end of line. */
+    if (*s == '#') {
+      while (*lx.s && *lx.s != '\n')
+        lx.s++;
       continue;
     }
 
-    /* Make sure there's enough space to add new token. */
-    if (ntoks == capacity) {
+    /* Make sure there's enough space to add new tokens. */
+    if (ntoks + 2 > capacity) {
       capacity *= 2;
       tokvec = realloc(tokvec, sizeof(token_t) * (capacity + 1));
     }
 
-    size_t l = strcspn(s, " |&<>;!");
-    if (l > 0) {
-      tokvec[ntoks++] = s;
-      s += l;
+    if (!strchr(SEPARATORS, *s) || procsubst_p(s)) {
+      char *word = lx.w;
+      if (procsubst_p(s))
+        scanprocsubst(&lx);
+      scanword(&lx, SEPARATORS);
+      *lx.w++ = '\0';
+      simplify(word);
+      /* Digits immediately followed by `<` or `>` name the descriptor to be
+       * redirected, e.g. `2>file`. */
+      if ((*lx.s == '<' || *lx.s == '>') &&
+          strspn(s, "0123456789") == (size_t)(lx.s - s))
+        tokvec[ntoks++] = T_IONUMBER;
+      /* Exclamation mark is an operator only when it stands alone. */
+      tokvec[ntoks++] = (lx.s == s + 1 && *s == '!') ? T_BANG : word;
       continue;
     }
 
@@ -42,35 +350,78 @@ token_t *tokenize(char *s, int *tokc_p) {
 
     if (s[0] == '|') {
       if (s[1] == '|') {
-        *s++ = 0;
+        lx.s++;
         tok = T_OR;
       } else {
         tok = T_PIPE;
       }
     } else if (s[0] == '&') {
       if (s[1] == '&') {
-        *s++ = 0;
+        lx.s++;
         tok = T_AND;
       } else {
         tok = T_BGJOB;
       }
     } else if (s[0] == '<') {
-      tok = T_INPUT;
+      if (s[1] == '<' && s[2] == '<') {
+        lx.s += 2;
+        tok = T_HERESTR;
+      } else if (s[1] == '<') {
+        lx.s++;
+        tok = T_HEREDOC;
+      } else if (s[1] == '&') {
+        lx.s++;
+        tok = T_DUPIN;
+      } else if (s[1] == '>') {
+        lx.s++;
+        tok = T_RDWR;
+      } else {
+        tok = T_INPUT;
+      }
     } else if (s[0] == '>') {
-      tok = T_OUTPUT;
+      if (s[1] == '>') {
+        lx.s++;
+        tok = T_APPEND;
+      } else if (s[1] == '&') {
+        lx.s++;
+        tok = T_DUPOUT;
+      } else {
+        /* There's no noclobber option, so `>|` is the same as `>`. */
+        lx.s += (s[1] == '|');
+        tok = T_OUTPUT;
+      }
     } else if (s[0] == ';') {
       tok = T_COLON;
-    } else if (s[0] == '!') {
-      tok = T_BANG;
+    } else if (s[0] == '\n') {
+      tok = T_NEWLINE;
+    } else if (s[0] == '(') {
+      tok = T_LPAREN;
+    } else if (s[0] == ')') {
+      tok = T_RPAREN;
     } else {
       continue;
     }
 
-    *s++ = 0;
+    lx.s++;
     tokvec[ntoks++] = tok;
+
+    if (tok == T_HEREDOC)
+      scandelim(&lx, tokvec, &ntoks);
+
+    /* Bodies of here-documents follow the line with operators. */
+    if (tok == T_NEWLINE) {
+      for (int i = 0; i < lx.nheredocs && !lx.incomplete; i++) {
+        tokvec[lx.heredocs[i].slot] = lx.w;
+        scanbody(&lx, &lx.heredocs[i]);
+        *lx.w++ = '\0';
+      }
+      lx.nheredocs = 0;
+    }
   }
 
   tokvec[ntoks] = NULL;
   *tokc_p = ntoks;
+  *incompletep = lx.incomplete || lx.nheredocs > 0;
+  free(lx.heredocs);
   return tokvec;
 }
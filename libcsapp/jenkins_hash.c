@@ -36,6 +36,10 @@ on 1 byte), but shoehorning those bytes into integers efficiently is messy.
 -------------------------------------------------------------------------------
 */
 
+/* Masked reads past the end of the key are intentional (see below),
+ * so keep AddressSanitizer from reporting them. */
+#define __no_sanitize_address __attribute__((no_sanitize_address))
+
 #define rot(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
 
 /*
@@ -225,6 +229,7 @@ acceptable.  Do NOT use for cryptographic purposes.
 -------------------------------------------------------------------------------
 */
 
+__no_sanitize_address
 uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
   uint32_t a, b, c; /* internal state */
   union {
@@ -438,6 +443,7 @@ uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
  * from hashlittle() on all machines.  hashbig() takes advantage of
  * big-endian byte ordering.
  */
+__no_sanitize_address
 uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
   uint32_t a, b, c;
   union {
@@ -0,0 +1,56 @@
+#include "csapp.h"
+
+/* Generates perfect hash table of builtin commands. The table has twice as
+ * many slots as there are builtins, rounded up to a power of two. We look for
+ * a seed for `jenkins_hash` that maps each builtin name to a distinct slot,
+ * so that a lookup needs one hash and at most one string comparison. */
+
+typedef struct {
+  const char *name;
+  const char *func;
+  const char *flags;
+} builtin_t;
+
+#define BUILTIN(name, func, flags) {name, #func, #flags},
+static builtin_t builtins[] = {
+#include "builtins.def"
+};
+#undef BUILTIN
+
+#define NBUILTINS (sizeof(builtins) / sizeof(builtin_t))
+
+static uint32_t slot(const char *name, uint32_t seed, uint32_t mask) {
+  return jenkins_hash(name, strlen(name), seed) & mask;
+}
+
+int main(void) {
+  uint32_t size = 1;
+  while (size < 2 * NBUILTINS)
+    size *= 2;
+
+  uint32_t mask = size - 1;
+  int *used = calloc(size, sizeof(int));
+
+  for (uint32_t seed = HASHINIT;; seed++) {
+    bool ok = true;
+    memset(used, 0, size * sizeof(int));
+    for (size_t i = 0; i < NBUILTINS && ok; i++)
+      ok = !used[slot(builtins[i].name, seed, mask)]++;
+    if (!ok)
+      continue;
+
+    printf("/* Generated by mkbuiltins from builtins.def. Do not edit! */\n\n");
+    printf("#define BUILTIN_SEED %uU\n", seed);
+    printf("#define BUILTIN_MASK %uU\n\n", mask);
+    printf("static const command_t builtins[%u] = {\n", size);
+    for (size_t i = 0; i < NBUILTINS; i++)
+      printf("  [%u] = {\"%s\", %s, %s},\n",
+             slot(builtins[i].name, seed, mask), builtins[i].name,
+             builtins[i].func, builtins[i].flags);
+    printf("};\n");
+    break;
+  }
+
+  free(used);
+  return 0;
+}
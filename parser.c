@@ -0,0 +1,501 @@
+#include "shell.h"
+
+/* Syntax tree is allocated from chunks of memory released all at once. */
+typedef struct arena {
+  struct arena *next; /* previously filled chunk */
+  size_t used;        /* number of bytes handed out */
+  size_t size;        /* capacity of `data` */
+  char data[];
+} arena_t;
+
+#define CHUNKSZ 4096
+
+static void *palloc(cmd_t *cmd, size_t size) {
+  arena_t *a = cmd->arena;
+  size = (size + 7) & ~7;
+  if (a == NULL || a->used + size > a->size) {
+    size_t cap = max((size_t)CHUNKSZ, size);
+    a = malloc(sizeof(arena_t) + cap);
+    a->next = cmd->arena;
+    a->used = 0;
+    a->size = cap;
+    cmd->arena = a;
+  }
+  void *p = a->data + a->used;
+  a->used += size;
+  return memset(p, 0, size);
+}
+
+/* State of recursive descent parser. */
+typedef struct parser {
+  cmd_t *cmd;   /* command being built */
+  token_t *tok; /* current token */
+  int status;   /* P_OK, P_ERROR or P_INCOMPLETE */
+} parser_t;
+
+static node_t *parse_list(parser_t *p);
+
+static const char *tokname(token_t t) {
+  /* Must be kept in the same order as T_* constants! */
+  static const char *name[] = {
+    "end of file", "&&", "||", "|",   "&",  ";",  "newline",
+    ">",           "<",  ">>", "!",   "(",  ")",  "<<",
+    "<<<",         "<>", "<&", ">&",  "number"};
+  return string_p(t) ? t : name[(long)t];
+}
+
+/* Report unexpected token. Running out of tokens is not an error,
+ * since the rest of command may be provided in following lines. */
+static void *syntax_error(parser_t *p) {
+  if (p->status != P_OK)
+    return NULL;
+  if (*p->tok == T_NULL) {
+    p->status = P_INCOMPLETE;
+  } else if (*p->tok == T_IONUMBER) {
+    msg("syntax error near unexpected token '%s'\n", p->tok[1]);
+    p->status = P_ERROR;
+  } else {
+    msg("syntax error near unexpected token '%s'\n", tokname(*p->tok));
+    p->status = P_ERROR;
+  }
+  return NULL;
+}
+
+static bool keyword_p(token_t t, const char *kw) {
+  return string_p(t) && !strcmp(t, kw);
+}
+
+static bool accept_kw(parser_t *p, const char *kw) {
+  if (!keyword_p(*p->tok, kw))
+    return false;
+  p->tok++;
+  return true;
+}
+
+static bool expect(parser_t *p, const char *kw) {
+  if (accept_kw(p, kw))
+    return true;
+  syntax_error(p);
+  return false;
+}
+
+static void linebreak(parser_t *p) {
+  while (*p->tok == T_NEWLINE)
+    p->tok++;
+}
+
+static node_t *mknode(parser_t *p, int type) {
+  node_t *n = palloc(p->cmd, sizeof(node_t));
+  n->type = type;
+  return n;
+}
+
+/* Copy temporary vector of tokens into the arena. */
+static token_t *mkvec(parser_t *p, token_t *vec, int n) {
+  token_t *copy = palloc(p->cmd, sizeof(token_t) * (n + 1));
+  memcpy(copy, vec, sizeof(token_t) * n);
+  return copy;
+}
+
+/* Parse a list that must not be empty, e.g. body of a loop. */
+static node_t *parse_body(parser_t *p) {
+  node_t *n = parse_list(p);
+  if (n == NULL)
+    return syntax_error(p);
+  return n;
+}
+
+static node_t *parse_if(parser_t *p) {
+  node_t *n = mknode(p, N_IF);
+  if (!(n->left = parse_body(p)) || !expect(p, "then") ||
+      !(n->right = parse_body(p)))
+    return NULL;
+  if (accept_kw(p, "elif")) {
+    n->orelse = parse_if(p);
+    return n->orelse ? n : NULL;
+  }
+  if (accept_kw(p, "else") && !(n->orelse = parse_body(p)))
+    return NULL;
+  return expect(p, "fi") ? n : NULL;
+}
+
+static node_t *parse_loop(parser_t *p, int type) {
+  node_t *n = mknode(p, type);
+  if (!(n->left = parse_body(p)) || !expect(p, "do") ||
+      !(n->right = parse_body(p)) || !expect(p, "done"))
+    return NULL;
+  return n;
+}
+
+static node_t *parse_for(parser_t *p) {
+  node_t *n = mknode(p, N_FOR);
+
+  if (!string_p(*p->tok))
+    return syntax_error(p);
+  n->var = *p->tok++;
+
+  linebreak(p);
+  if (accept_kw(p, "in")) {
+    int nwords = 0;
+    while (string_p(p->tok[nwords]))
+      nwords++;
+    n->words = mkvec(p, p->tok, nwords);
+    p->tok += nwords;
+  }
+  if (*p->tok == T_COLON || *p->tok == T_NEWLINE)
+    p->tok++;
+  linebreak(p);
+
+  if (!expect(p, "do") || !(n->right = parse_body(p)) || !expect(p, "done"))
+    return NULL;
+  return n;
+}
+
+/* Parse compound command if current token starts one. */
+static node_t *parse_compound(parser_t *p) {
+  if (accept_kw(p, "if"))
+    return parse_if(p);
+  if (accept_kw(p, "while"))
+    return parse_loop(p, N_WHILE);
+  if (accept_kw(p, "until"))
+    return parse_loop(p, N_UNTIL);
+  if (accept_kw(p, "for"))
+    return parse_for(p);
+  if (accept_kw(p, "{")) {
+    node_t *n = mknode(p, N_GROUP);
+    if (!(n->right = parse_body(p)) || !expect(p, "}"))
+      return NULL;
+    return n;
+  }
+  if (*p->tok == T_LPAREN) {
+    p->tok++;
+    node_t *n = mknode(p, N_SUBSHELL);
+    if (!(n->right = parse_body(p)))
+      return NULL;
+    if (*p->tok != T_RPAREN)
+      return syntax_error(p);
+    p->tok++;
+    return n;
+  }
+  return NULL;
+}
+
+static bool compound_p(token_t t) {
+  return t == T_LPAREN || keyword_p(t, "if") || keyword_p(t, "while") ||
+         keyword_p(t, "until") || keyword_p(t, "for") || keyword_p(t, "{");
+}
+
+static bool redir_p(token_t t) {
+  return t == T_INPUT || t == T_OUTPUT || t == T_APPEND || t == T_RDWR ||
+         t == T_DUPIN || t == T_DUPOUT || t == T_HEREDOC || t == T_HERESTR;
+}
+
+/* Fill in descriptor and open flags of a redirection. Without a number
+ * operators starting with `<` redirect standard input, the rest redirect
+ * standard output. */
+static redir_t mkredir(token_t mode, const char *number, char *path) {
+  redir_t r = {.mode = mode, .path = path};
+  bool input = mode == T_INPUT || mode == T_RDWR || mode == T_DUPIN ||
+               mode == T_HEREDOC || mode == T_HERESTR;
+
+  if (number)
+    r.fd = min(strtol(number, NULL, 10), INT_MAX);
+  else
+    r.fd = input ? STDIN_FILENO : STDOUT_FILENO;
+
+  if (mode == T_INPUT)
+    r.flags = O_RDONLY;
+  else if (mode == T_OUTPUT)
+    r.flags = O_WRONLY | O_CREAT | O_TRUNC;
+  else if (mode == T_APPEND)
+    r.flags = O_WRONLY | O_CREAT | O_APPEND;
+  else if (mode == T_RDWR)
+    r.flags = O_RDWR | O_CREAT;
+  return r;
+}
+
+#define MAXALIAS 16 /* maximum number of aliases expanded in a command */
+
+/* Replace an alias at the beginning of a command with its tokenized value.
+ * Each alias is expanded once per command, which prevents infinite
+ * recursion for definitions like `alias ls='ls -F'`. */
+static void expand_alias(parser_t *p) {
+  const char *expanded[MAXALIAS];
+  const char *value;
+  int nexpanded = 0;
+
+  while (nexpanded < MAXALIAS && string_p(*p->tok) &&
+         (value = getalias(*p->tok))) {
+    for (int i = 0; i < nexpanded; i++)
+      if (!strcmp(expanded[i], *p->tok))
+        return;
+    expanded[nexpanded++] = *p->tok;
+
+    /* Words of the value live as long as the command text. */
+    char *buf = palloc(p->cmd, 2 * strlen(value) + 2);
+    int ntokens, nrest = 0;
+    bool incomplete;
+    token_t *tokens = tokenize(value, buf, &ntokens, &incomplete);
+
+    while (p->tok[nrest + 1] != T_NULL)
+      nrest++;
+
+    token_t *vec = palloc(p->cmd, sizeof(token_t) * (ntokens + nrest + 1));
+    memcpy(vec, tokens, sizeof(token_t) * ntokens);
+    memcpy(vec + ntokens, p->tok + 1, sizeof(token_t) * nrest);
+    free(tokens);
+    p->tok = vec;
+  }
+}
+
+static bool parse_command(parser_t *p, stage_t *st);
+
+static bool assignment_p(token_t t) {
+  char *eq = string_p(t) ? strchr(t, '=') : NULL;
+  return eq && varname_p(t, eq - t);
+}
+
+/* Parse `name() compound-command`. Definition itself is a command, which
+ * registers the function when evaluated. */
+static bool parse_funcdef(parser_t *p, stage_t *st) {
+  node_t *n = mknode(p, N_FUNCDEF);
+  n->var = *p->tok;
+  n->cmd = p->cmd;
+  p->tok += 3;
+
+  linebreak(p);
+  if (!compound_p(*p->tok)) {
+    syntax_error(p);
+    return false;
+  }
+
+  n->stage = palloc(p->cmd, sizeof(stage_t));
+  n->nstages = 1;
+  if (!parse_command(p, n->stage))
+    return false;
+
+  st->node = n;
+  st->argv = mkvec(p, &n->var, 1);
+  st->argc = 1;
+  return true;
+}
+
+/* Parse simple or compound command followed by redirections. Redirection
+ * operators with file names are moved out of argument vector. */
+static bool parse_command(parser_t *p, stage_t *st) {
+  expand_alias(p);
+
+  if (string_p(p->tok[0]) && p->tok[1] == T_LPAREN && p->tok[2] == T_RPAREN)
+    return parse_funcdef(p, st);
+
+  token_t kw = *p->tok;
+
+  if (compound_p(kw) && !(st->node = parse_compound(p)))
+    return false;
+
+  int ntokens = 0;
+  while (p->tok[ntokens] != T_NULL && !separator_p(p->tok[ntokens]) &&
+         p->tok[ntokens] != T_RPAREN)
+    ntokens++;
+
+  token_t argv[ntokens + 2];
+  redir_t redir[ntokens + 1];
+  int argc = 0, nredir = 0;
+
+  if (st->node)
+    argv[argc++] = kw == T_LPAREN ? "(" : kw;
+
+  while (true) {
+    token_t t = *p->tok;
+    const char *number = NULL;
+    if (t == T_IONUMBER) {
+      /* Lexer puts redirection operator right after the number. */
+      number = p->tok[1];
+      p->tok += 2;
+      t = *p->tok;
+    }
+    if (redir_p(t)) {
+      if (!string_p(p->tok[1])) {
+        p->tok++;
+        syntax_error(p);
+        return false;
+      }
+      redir[nredir++] = mkredir(t, number, p->tok[1]);
+      p->tok += 2;
+    } else if (st->node == NULL && (string_p(t) || t == T_BANG)) {
+      /* Exclamation mark not at the beginning of pipeline is a word. */
+      argv[argc++] = string_p(t) ? t : "!";
+      p->tok++;
+    } else {
+      break;
+    }
+  }
+
+  /* Assignments before command name apply to that command only. Command
+   * that consists of assignments only sets shell variables. */
+  int nassigns = 0;
+  while (st->node == NULL && nassigns < argc && assignment_p(argv[nassigns]))
+    nassigns++;
+  if (nassigns > 0) {
+    st->assigns = mkvec(p, argv, nassigns);
+  } else if (argc == 0) {
+    syntax_error(p);
+    return false;
+  }
+
+  argc -= nassigns;
+  st->argv = mkvec(p, argv + nassigns, argc);
+  st->argc = argc;
+  for (int i = 0; i < argc; i++)
+    st->expand |= needexp_p(st->argv[i]);
+  st->redir = palloc(p->cmd, sizeof(redir_t) * nredir);
+  memcpy(st->redir, redir, sizeof(redir_t) * nredir);
+  st->nredir = nredir;
+  return true;
+}
+
+static node_t *parse_pipeline(parser_t *p) {
+  node_t *n = mknode(p, N_PIPELINE);
+
+  if (*p->tok == T_BANG) {
+    n->negate = true;
+    p->tok++;
+  }
+
+  /* Number of stages is not known in advance, as aliases may expand to
+   * pipelines, so they are gathered in a temporary vector. */
+  stage_t *stages = NULL;
+  int nstages = 0;
+  bool ok;
+
+  do {
+    stages = realloc(stages, sizeof(stage_t) * (nstages + 1));
+    memset(&stages[nstages], 0, sizeof(stage_t));
+    if (!(ok = parse_command(p, &stages[nstages++])))
+      break;
+    if (*p->tok != T_PIPE)
+      break;
+    p->tok++;
+    linebreak(p);
+  } while (true);
+
+  n->stage = palloc(p->cmd, sizeof(stage_t) * nstages);
+  memcpy(n->stage, stages, sizeof(stage_t) * nstages);
+  n->nstages = nstages;
+  free(stages);
+
+  return ok ? n : NULL;
+}
+
+static node_t *parse_andor(parser_t *p) {
+  node_t *n = parse_pipeline(p);
+
+  while (n && (*p->tok == T_AND || *p->tok == T_OR)) {
+    node_t *op = mknode(p, *p->tok == T_AND ? N_AND : N_OR);
+    p->tok++;
+    linebreak(p);
+    op->left = n;
+    op->right = parse_pipeline(p);
+    n = op->right ? op : NULL;
+  }
+
+  return n;
+}
+
+/* List ends with end of text or a token that closes enclosing construct. */
+static bool endlist_p(token_t t) {
+  static const char *closing[] = {"then", "elif", "else", "fi", "do",
+                                  "done", "}",    NULL};
+  if (t == T_NULL || t == T_RPAREN)
+    return true;
+  for (const char **kw = closing; *kw; kw++)
+    if (keyword_p(t, *kw))
+      return true;
+  return false;
+}
+
+static node_t *parse_list(parser_t *p) {
+  node_t *head = NULL, **tail = &head;
+
+  linebreak(p);
+
+  while (!endlist_p(*p->tok)) {
+    node_t *n = parse_andor(p);
+    if (n == NULL)
+      return NULL;
+    *tail = n;
+    tail = &n->next;
+
+    token_t t = *p->tok;
+    if (t == T_COLON || t == T_BGJOB) {
+      n->bg = (t == T_BGJOB);
+      p->tok++;
+    } else if (t != T_NEWLINE) {
+      break;
+    }
+    linebreak(p);
+  }
+
+  return head;
+}
+
+/* Tokenize a copy of command text and build its syntax tree.
+ * Returns NULL and sets status if text is not a complete command. */
+cmd_t *parse(const char *text, int *statusp) {
+  cmd_t *cmd = calloc(1, sizeof(cmd_t));
+  int ntokens;
+  bool incomplete;
+
+  cmd->refcnt = 1;
+  cmd->line = malloc(2 * strlen(text) + 2);
+  cmd->token = tokenize(text, cmd->line, &ntokens, &incomplete);
+
+  parser_t p = {.cmd = cmd, .tok = cmd->token, .status = P_OK};
+
+  if (incomplete) {
+    p.status = P_INCOMPLETE;
+  } else {
+    cmd->root = parse_list(&p);
+    if (p.status == P_OK && *p.tok != T_NULL)
+      syntax_error(&p);
+  }
+
+  *statusp = p.status;
+  if (p.status != P_OK) {
+    freecmd(cmd);
+    return NULL;
+  }
+  return cmd;
+}
+
+static void freenode(node_t *n) {
+  for (; n != NULL; n = n->next) {
+    for (int i = 0; i < n->nstages; i++)
+      freenode(n->stage[i].node);
+    freenode(n->left);
+    freenode(n->right);
+    freenode(n->orelse);
+  }
+}
+
+/* Take a reference to command, so that its syntax tree outlives the cache
+ * entry or the line it was read from. */
+cmd_t *holdcmd(cmd_t *cmd) {
+  cmd->refcnt++;
+  return cmd;
+}
+
+/* Drop a reference to command and free it when the last one is gone. */
+void freecmd(cmd_t *cmd) {
+  if (--cmd->refcnt > 0)
+    return;
+  freenode(cmd->root);
+  while (cmd->arena) {
+    arena_t *a = cmd->arena;
+    cmd->arena = a->next;
+    free(a);
+  }
+  free(cmd->token);
+  free(cmd->line);
+  free(cmd);
+}
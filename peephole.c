@@ -0,0 +1,239 @@
+#include "shell.h"
+
+/* Pipelines are rewritten just before they are evaluated, as some rewrites
+ * depend on functions defined and files present at that moment:
+ *  - `cat file | cmd` becomes `cmd <file`, if `file` is a regular file and
+ *    `cmd` is a program or is followed by other stages,
+ *  - `cat` without arguments between two stages is dropped,
+ *  - a redirection that repeats the one right before it is dropped,
+ *    e.g. `cmd >out >out` becomes `cmd >out`.
+ * First two save a process and copying data through a pipe each.
+ *
+ * Setting PEEPHOLE variable to `off` disables rewrites, while `debug` makes
+ * the shell print each rewrite to standard error.
+ *
+ * Syntax tree is shared with the cache of parsed commands, hence rewritten
+ * pipeline is a temporary copy of the original one. Stages of the copy share
+ * words with the original. */
+
+/* Returns true if stage runs `cat` program with `argc` words. */
+static bool cat_p(stage_t *st, int argc) {
+  if (st->node || st->assigns || st->nredir > 0 || st->argc != argc)
+    return false;
+  for (int i = 0; i < argc; i++)
+    if (needexp_p(st->argv[i]))
+      return false;
+  const char *name = strrchr(st->argv[0], '/');
+  return !strcmp(name ? name + 1 : st->argv[0], "cat");
+}
+
+/* Returns true if the name denotes a program rather than builtin or function,
+ * i.e. it does what its name says. */
+static bool program_p(const char *name) {
+  builtin_t builtin;
+  function_t *fn;
+  return lookup(name, &builtin, NULL, &fn) == C_EXTERNAL;
+}
+
+/* Returns true if `cat file` may be replaced with `<file` redirection of its
+ * consumer. Unlike the redirection `cat` doesn't give up on a missing file,
+ * and compound commands or functions with redirections need a subshell. */
+static bool catfile_p(stage_t *st, stage_t *next) {
+  if (!cat_p(st, 2) || *st->argv[1] == '-' || next->node || next->argc == 0 ||
+      needexp_p(next->argv[0]))
+    return false;
+
+  builtin_t builtin;
+  function_t *fn;
+  if (lookup(next->argv[0], &builtin, NULL, &fn) == C_FUNCTION ||
+      !program_p(st->argv[0]))
+    return false;
+
+  struct stat sb;
+  return stat(st->argv[1], &sb) == 0 && S_ISREG(sb.st_mode) &&
+         access(st->argv[1], R_OK) == 0;
+}
+
+/* Opening the same file twice for the same descriptor has the effect of
+ * opening it once. Expansion of the path might have side effects, so only
+ * plain words are compared. */
+static bool samefile_p(redir_t *a, redir_t *b) {
+  if (a->mode != b->mode || a->fd != b->fd || a->flags != b->flags ||
+      a->mode == T_HEREDOC || a->mode == T_HERESTR)
+    return false;
+  return !needexp_p(a->path) && !strcmp(a->path, b->path);
+}
+
+static bool duplicates_p(stage_t *st) {
+  for (int i = 1; i < st->nredir; i++)
+    if (samefile_p(&st->redir[i - 1], &st->redir[i]))
+      return true;
+  return false;
+}
+
+/* Give stage its own redirections, preceded by `<input` if it's not NULL,
+ * with repeated ones dropped. */
+static void rewrite_redirs(stage_t *st, char *input) {
+  redir_t *redir = malloc(sizeof(redir_t) * (st->nredir + 1));
+  int n = 0;
+
+  if (input)
+    redir[n++] = (redir_t){T_INPUT, STDIN_FILENO, O_RDONLY, input};
+  for (int i = 0; i < st->nredir; i++)
+    if (n == 0 || !samefile_p(&redir[n - 1], &st->redir[i]))
+      redir[n++] = st->redir[i];
+
+  st->redir = redir;
+  st->nredir = n;
+}
+
+/* Cheap test whether any rewrite might apply, so that most pipelines do not
+ * look up PEEPHOLE variable. */
+static bool candidate_p(node_t *n) {
+  int last = n->nstages - 1;
+  if (last > 0 && cat_p(&n->stage[0], 2))
+    return true;
+  for (int i = 0; i <= last; i++) {
+    if (i > 0 && i < last && cat_p(&n->stage[i], 1))
+      return true;
+    if (duplicates_p(&n->stage[i]))
+      return true;
+  }
+  return false;
+}
+
+static const char *redirop(token_t mode) {
+  if (mode == T_INPUT)
+    return "<";
+  if (mode == T_OUTPUT)
+    return ">";
+  if (mode == T_APPEND)
+    return ">>";
+  if (mode == T_RDWR)
+    return "<>";
+  if (mode == T_DUPIN)
+    return "<&";
+  if (mode == T_DUPOUT)
+    return ">&";
+  if (mode == T_HEREDOC)
+    return "<<";
+  return "<<<";
+}
+
+/* Append word with quote marks of the lexer removed. */
+static void appendword(char **linep, const char *word) {
+  char *plain = strdup(word), *p = plain;
+  for (const char *w = word; *w; w++)
+    if (*w != CTLESC && *w != CTLQUOTE && *w != CTLPROC)
+      *p++ = *w;
+  *p = '\0';
+  strapp(linep, plain);
+  free(plain);
+}
+
+/* Textual form of a pipeline for the debug output. */
+static char *showpipeline(node_t *n) {
+  char *line = strdup("");
+  char number[16];
+
+  for (int i = 0; i < n->nstages; i++) {
+    stage_t *st = &n->stage[i];
+    if (i > 0)
+      strapp(&line, " | ");
+    for (int j = 0; j < st->argc; j++) {
+      if (j > 0)
+        strapp(&line, " ");
+      appendword(&line, st->argv[j]);
+    }
+    for (int j = 0; j < st->nredir; j++) {
+      redir_t *r = &st->redir[j];
+      const char *op = redirop(r->mode);
+      strapp(&line, " ");
+      if (r->fd != (*op == '<' ? STDIN_FILENO : STDOUT_FILENO)) {
+        snprintf(number, sizeof(number), "%d", r->fd);
+        strapp(&line, number);
+      }
+      strapp(&line, op);
+      if (r->mode != T_HEREDOC)
+        appendword(&line, r->path);
+    }
+  }
+  return line;
+}
+
+/* Returns pipeline to be evaluated in place of `n`. If it differs from `n`,
+ * it must be released with `freepeephole` after evaluation. */
+node_t *peephole(node_t *n) {
+  if (!candidate_p(n))
+    return n;
+
+  const char *mode = getvar("PEEPHOLE");
+  if (mode && !strcmp(mode, "off"))
+    return n;
+
+  node_t *p = malloc(sizeof(node_t));
+  *p = *n;
+  p->stage = malloc(sizeof(stage_t) * n->nstages);
+  p->nstages = 0;
+
+  int last = n->nstages - 1;
+  char *input = NULL;
+  bool changed = false;
+
+  for (int i = 0; i <= last; i++) {
+    stage_t *st = &n->stage[i];
+    if (i == 0 && last > 0 && catfile_p(st, &n->stage[1])) {
+      input = st->argv[1];
+      changed = true;
+      continue;
+    }
+    if (i > 0 && i < last && cat_p(st, 1) && program_p(st->argv[0])) {
+      changed = true;
+      continue;
+    }
+    stage_t *copy = &p->stage[p->nstages++];
+    *copy = *st;
+    if (input || duplicates_p(st)) {
+      rewrite_redirs(copy, input);
+      input = NULL;
+      changed = true;
+    }
+  }
+
+  /* Stages of a pipeline run in subshells, but a lone builtin would run
+   * within the shell, e.g. `cat f | cd /` must not change directory. */
+  if (changed && p->nstages == 1 && !program_p(p->stage[0].argv[0])) {
+    freepeephole(n, p);
+    return n;
+  }
+
+  if (!changed) {
+    free(p->stage);
+    free(p);
+    return n;
+  }
+
+  if (mode && !strcmp(mode, "debug")) {
+    char *before = showpipeline(n), *after = showpipeline(p);
+    msg("peephole: %s -> %s\n", before, after);
+    free(before);
+    free(after);
+  }
+  return p;
+}
+
+/* Release pipeline rewritten from `n`. Paths of programs found while it was
+ * evaluated are kept in the original stages. */
+void freepeephole(node_t *n, node_t *p) {
+  for (int i = 0; i < p->nstages; i++) {
+    stage_t *copy = &p->stage[i], *st = n->stage;
+    while (st->argv != copy->argv)
+      st++;
+    st->path = copy->path;
+    st->pathgen = copy->pathgen;
+    if (copy->redir != st->redir)
+      free(copy->redir);
+  }
+  free(p->stage);
+  free(p);
+}
@@ -0,0 +1,479 @@
+#include "shell.h"
+#include <sys/un.h>
+
+/* Redirections of a command are not applied to descriptors of the shell one
+ * by one. The shell opens files with O_CLOEXEC and records in a plan which
+ * of its descriptors each redirected descriptor of the command refers to.
+ * A builtin run by the shell takes its standard streams from the plan,
+ * while a child moves descriptors into place with one dup2 per descriptor
+ * that differs from the shell's.
+ *
+ * Files opened for `<`, `>`, `>>` and `<>` get kernel hints listed in IOHINTS
+ * variable, if it's set. Hints apply to all redirections of a command and
+ * can also be set for a single command, e.g.
+ * `IOHINTS='noatime prealloc=1G' sort <in >out`. Hints are:
+ *  - sequential: posix_fadvise(POSIX_FADV_SEQUENTIAL) on the file,
+ *  - readahead: start reading the beginning of input file at once,
+ *  - noatime: open input file with O_NOATIME if we own it,
+ *  - prealloc=SIZE: reserve SIZE bytes (with K, M or G suffix) for output,
+ *  - none: no hints.
+ *
+ * Capacity of pipes connecting stages of pipelines is taken from PIPESIZE
+ * variable, e.g. `PIPESIZE=1M`. Assigned before the first command of
+ * a pipeline it applies to that pipeline only, e.g.
+ * `PIPESIZE=4M zcat log.gz | grep x | sort`. Such an assignment is taken into
+ * account only if it needs no expansion, which is left to the command.
+ *
+ * Paths of the form `unix:/path` and `tcp:host:port` name stream sockets,
+ * that the shell connects to instead of opening a file, e.g.
+ * `make 2>&1 >unix:/run/collector.sock`. A file with such a name can still
+ * be given as `./tcp:...`. */
+
+#define READAHEAD_SIZE (1 << 21) /* bytes of input read in advance */
+#define PIPE_MAX_SIZE "/proc/sys/fs/pipe-max-size"
+
+static bool parsesize(const char *s, off_t *sizep);
+
+/* Returns the largest pipe capacity an unprivileged process may request. */
+static int maxpipesize(void) {
+  static int maxsize = 0;
+
+  if (maxsize == 0) {
+    char buf[32] = {};
+    int fd = open(PIPE_MAX_SIZE, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      if (read(fd, buf, sizeof(buf) - 1) > 0)
+        maxsize = atoi(buf);
+      Close(fd);
+    }
+    if (maxsize <= 0)
+      maxsize = 1 << 20;
+  }
+  return maxsize;
+}
+
+/* Returns capacity of pipes requested with PIPESIZE for a pipeline, whose
+ * first command is preceded by `assigns`, or 0 if default is to be used. */
+int pipesize(token_t *assigns) {
+  const char *spec = getvar("PIPESIZE");
+  off_t size;
+
+  for (; assigns && *assigns; assigns++)
+    if (!strncmp(*assigns, "PIPESIZE=", 9) && !needexp_p(*assigns + 9))
+      spec = *assigns + 9;
+
+  if (spec == NULL || *spec == '\0') {
+    size = 0;
+  } else if (!parsesize(spec, &size)) {
+    msg("PIPESIZE: invalid size '%s'\n", spec);
+    size = 0;
+  }
+  return size > 0 ? min(size, maxpipesize()) : 0;
+}
+
+/* Make a pipe of given capacity, unless `size` is 0. Kernel may refuse to
+ * enlarge the pipe, e.g. if the user has too many big pipes already. */
+void mkpipe(int *readp, int *writep, int size) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0)
+    unix_error("pipe2 error");
+  if (size > 0)
+    (void)fcntl(fds[1], F_SETPIPE_SZ, size);
+  *readp = fds[0];
+  *writep = fds[1];
+}
+
+/* Returns a file that lives in memory. */
+int memfile(const char *name) {
+  int fd = memfd_create(name, MFD_CLOEXEC);
+  if (fd < 0)
+    unix_error("memfd_create error");
+  return fd;
+}
+
+/* Returns descriptor to read here-document or here-string from. Short text
+ * fits into a pipe buffer at once, longer one is put into a memory file.
+ * Neither of them touches the file system. */
+static int heredoc(const char *text, bool newline) {
+  struct iovec iov[2] = {
+    {.iov_base = (void *)text, .iov_len = strlen(text)},
+    {.iov_base = "\n", .iov_len = newline},
+  };
+  int input, output;
+
+  if (iov[0].iov_len + iov[1].iov_len <= PIPE_BUF)
+    mkpipe(&input, &output, 0);
+  else
+    input = output = memfile("heredoc");
+
+  Writev(output, iov, 2);
+
+  if (input == output)
+    Lseek(input, 0, SEEK_SET);
+  else
+    Close(output);
+  return input;
+}
+
+static fdmove_t *findmove(fdplan_t *plan, int fd) {
+  for (int i = 0; i < plan->nmoves; i++)
+    if (plan->moves[i].fd == fd)
+      return &plan->moves[i];
+  return NULL;
+}
+
+static void setmove(fdplan_t *plan, int fd, int source) {
+  fdmove_t *m = findmove(plan, fd);
+  if (m == NULL)
+    m = &plan->moves[plan->nmoves++];
+  *m = (fdmove_t){fd, source};
+}
+
+static void addopened(fdplan_t *plan, int fd) {
+  plan->opened[plan->nopened++] = fd;
+}
+
+static bool parsesize(const char *s, off_t *sizep) {
+  char *end;
+  errno = 0;
+  long long size = strtoll(s, &end, 10);
+  if (errno || end == s || size < 0)
+    return false;
+  const char *units = "KMG";
+  const char *u = *end ? strchr(units, toupper(*end)) : NULL;
+  if (u) {
+    size <<= 10 * (u - units + 1);
+    end++;
+  }
+  *sizep = size;
+  return *end == '\0';
+}
+
+static void parsehints(iohints_t *h, const char *spec) {
+  char *copy = strdup(spec);
+  char *saveptr;
+
+  *h = (iohints_t){};
+  for (char *w = strtok_r(copy, " \t,", &saveptr); w;
+       w = strtok_r(NULL, " \t,", &saveptr)) {
+    if (!strcmp(w, "sequential"))
+      h->sequential = true;
+    else if (!strcmp(w, "readahead"))
+      h->readahead = true;
+    else if (!strcmp(w, "noatime"))
+      h->noatime = true;
+    else if (!strncmp(w, "prealloc=", 9) && parsesize(w + 9, &h->prealloc))
+      continue;
+    else if (strcmp(w, "none"))
+      msg("IOHINTS: unknown hint '%s'\n", w);
+  }
+  free(copy);
+}
+
+/* Prepare plan for `nredir` redirections. Pipe ends `input` and `output`,
+ * if not negative, become standard input and output of the command.
+ * Assignments preceding the command may override IOHINTS. */
+void initplan(fdplan_t *plan, int nredir, int input, int output,
+              char **assigns) {
+  plan->moves = malloc(sizeof(fdmove_t) * (nredir + 2));
+  /* Breaking cycles may take a temporary descriptor per two moves. */
+  plan->opened = malloc(sizeof(int) * (nredir + 2) * 2);
+  plan->nmoves = plan->nopened = 0;
+  plan->hints = (iohints_t){};
+  if (nredir > 0) {
+    const char *spec = getvar("IOHINTS");
+    for (; assigns && *assigns; assigns++)
+      if (!strncmp(*assigns, "IOHINTS=", 8))
+        spec = *assigns + 8;
+    if (spec)
+      parsehints(&plan->hints, spec);
+  }
+  if (input >= 0) {
+    setmove(plan, STDIN_FILENO, input);
+    addopened(plan, input);
+  }
+  if (output >= 0) {
+    setmove(plan, STDOUT_FILENO, output);
+    addopened(plan, output);
+  }
+}
+
+/* Returns descriptor of the shell that descriptor `fd` of the command refers
+ * to, or -1 if it's closed. */
+int planfd(fdplan_t *plan, int fd) {
+  fdmove_t *m = findmove(plan, fd);
+  return m ? m->source : fd;
+}
+
+/* Returns descriptor named by the word following `<&` or `>&`. */
+static int dupsource(fdplan_t *plan, const char *word) {
+  char *end;
+  errno = 0;
+  long fd = strtol(word, &end, 10);
+  if (!isdigit(*word) || *end || errno || fd > INT_MAX)
+    return -1;
+  if (findmove(plan, fd))
+    return planfd(plan, fd);
+  return fcntl(fd, F_GETFD) < 0 ? -1 : fd;
+}
+
+/* Connect to socket `path` named as described above. Returns -1 with errno
+ * set or -2 if the error was already reported, like `open_clientfd` does. */
+static int opensocket(const char *path) {
+  int fd;
+
+  if (!strncmp(path, "unix:", 5)) {
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    if (strlen(path + 5) >= sizeof(sun.sun_path))
+      return errno = ENAMETOOLONG, -1;
+    strcpy(sun.sun_path, path + 5);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+      return -1;
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+      int error = errno;
+      Close(fd);
+      return errno = error, -1;
+    }
+    return fd;
+  }
+
+  const char *colon = strrchr(path + 4, ':');
+  if (colon == NULL || colon == path + 4)
+    return errno = EINVAL, -1;
+  char *host = strndup(path + 4, colon - path - 4);
+  char *port = strdup(colon + 1);
+  fd = open_clientfd(host, port);
+  free(host);
+  free(port);
+
+  if (fd >= 0)
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+static bool socket_p(const char *path) {
+  return !strncmp(path, "unix:", 5) || !strncmp(path, "tcp:", 4);
+}
+
+/* Open file of a redirection and apply hints to it. Errors of hints are
+ * ignored, e.g. a pipe cannot be advised and a file system may not support
+ * preallocation. */
+static int openfile(redir_t *r, const char *path, iohints_t *h) {
+  int flags = r->flags | O_CLOEXEC;
+  int mode = flags & O_ACCMODE;
+  int fd = -1;
+
+  if (socket_p(path))
+    return opensocket(path);
+
+  /* O_NOATIME is permitted only to the owner of a file. */
+  if (mode == O_RDONLY && h->noatime &&
+      (fd = open(path, flags | O_NOATIME)) < 0 && errno != EPERM)
+    return -1;
+  if (fd < 0 && (fd = open(path, flags, 0666)) < 0)
+    return -1;
+
+  if (h->sequential)
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if (mode == O_RDONLY && h->readahead)
+    (void)readahead(fd, 0, READAHEAD_SIZE);
+  if (mode == O_WRONLY && h->prealloc > 0) {
+    off_t start = (flags & O_APPEND) ? lseek(fd, 0, SEEK_END) : 0;
+    /* File size does not change, if less is written it's not padded. */
+    (void)fallocate(fd, FALLOC_FL_KEEP_SIZE, max(start, 0), h->prealloc);
+  }
+  return fd;
+}
+
+/* Add redirection, which operand is `path` after expansion, to the plan.
+ * Errors are reported and make the function return false. */
+bool addredir(fdplan_t *plan, redir_t *r, const char *path) {
+  int source;
+
+  /* Descriptor beyond the limit would make dup2 fail in the child. */
+  if (r->fd > 9 && r->fd >= getdtablesize()) {
+    msg("%d: bad file descriptor\n", r->fd);
+    return false;
+  }
+
+  if (r->mode == T_DUPIN || r->mode == T_DUPOUT) {
+    if (!strcmp(path, "-")) {
+      source = -1;
+    } else if ((source = dupsource(plan, path)) < 0) {
+      msg("%s: bad file descriptor\n", path);
+      return false;
+    }
+  } else if (r->mode == T_HEREDOC || r->mode == T_HERESTR) {
+    source = heredoc(path, r->mode == T_HERESTR);
+    addopened(plan, source);
+  } else {
+    if ((source = openfile(r, path, &plan->hints)) < 0) {
+      if (source == -1)
+        msg("%s: %s\n", path, strerror(errno));
+      return false;
+    }
+    addopened(plan, source);
+  }
+
+  setmove(plan, r->fd, source);
+  return true;
+}
+
+/* Returns true if descriptor `fd` is still needed as a source of a move that
+ * was not done yet, other than `self`. */
+static bool needed_p(fdplan_t *plan, bool *done, int fd, int self) {
+  for (int i = 0; i < plan->nmoves; i++)
+    if (i != self && !done[i] && plan->moves[i].source == fd)
+      return true;
+  return false;
+}
+
+static bool opened_p(fdplan_t *plan, int fd) {
+  for (int i = 0; i < plan->nopened; i++)
+    if (plan->opened[i] == fd)
+      return true;
+  return false;
+}
+
+/* Move descriptors into place. A descriptor is overwritten only once no
+ * pending move reads from it. Moves left over form cycles, e.g.
+ * `3>&1 1>&2 2>&3`, which are broken with a temporary copy. */
+static void moveall(fdplan_t *plan) {
+  fdmove_t *moves = plan->moves;
+  int n = plan->nmoves, left = n, maxfd = 0;
+  bool done[n];
+
+  for (int i = 0; i < n; i++) {
+    done[i] = false;
+    maxfd = max(maxfd, moves[i].fd);
+  }
+
+  while (left > 0) {
+    int pending = -1;
+    bool progress = false;
+    for (int i = 0; i < n; i++) {
+      fdmove_t *m = &moves[i];
+      if (done[i])
+        continue;
+      if (needed_p(plan, done, m->fd, i)) {
+        pending = i;
+        continue;
+      }
+      if (m->source < 0)
+        (void)close(m->fd);
+      else if (m->source != m->fd)
+        Dup2(m->source, m->fd);
+      else if (opened_p(plan, m->fd))
+        fcntl(m->fd, F_SETFD, 0);
+      done[i] = true;
+      progress = true;
+      left--;
+    }
+    if (!progress) {
+      int fd = moves[pending].fd;
+      int tmp = fcntl(fd, F_DUPFD_CLOEXEC, maxfd + 1);
+      if (tmp < 0)
+        unix_error("fcntl error");
+      for (int i = 0; i < n; i++)
+        if (!done[i] && moves[i].source == fd)
+          moves[i].source = tmp;
+      addopened(plan, tmp);
+    }
+  }
+}
+
+/* Close descriptors opened for the command, that are not in place. */
+static void closeopened(fdplan_t *plan) {
+  for (int i = 0; i < plan->nopened; i++)
+    if (!findmove(plan, plan->opened[i]))
+      Close(plan->opened[i]);
+}
+
+/* Descriptors above stderr passed to all children. */
+static int *keptfds = NULL;
+static int nkept = 0;
+
+static int fdcmp(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+/* Remember that descriptor `fd` above stderr is to be passed to children
+ * of the process, or not. */
+static void setkept(int fd, bool kept) {
+  int i = 0;
+  while (i < nkept && keptfds[i] != fd)
+    i++;
+  if (kept && i == nkept) {
+    keptfds = realloc(keptfds, sizeof(int) * (nkept + 1));
+    keptfds[nkept++] = fd;
+  } else if (!kept && i < nkept) {
+    keptfds[i] = keptfds[--nkept];
+  }
+}
+
+static void updatekept(fdplan_t *plan) {
+  for (int i = 0; i < plan->nmoves; i++)
+    if (plan->moves[i].fd > STDERR_FILENO)
+      setkept(plan->moves[i].fd, plan->moves[i].source >= 0);
+}
+
+/* Close all descriptors above stderr except kept ones. Returns false if
+ * kernel does not support close_range. */
+static bool sweep(void) {
+  int keep[nkept];
+  unsigned first = STDERR_FILENO + 1;
+
+  memcpy(keep, keptfds, sizeof(int) * nkept);
+  qsort(keep, nkept, sizeof(int), fdcmp);
+  for (int i = 0; i < nkept; i++) {
+    if ((unsigned)keep[i] > first && close_range(first, keep[i] - 1, 0) < 0)
+      return false;
+    first = max(first, (unsigned)keep[i] + 1);
+  }
+  return close_range(first, ~0U, 0) == 0;
+}
+
+/* Move descriptors into place in a child and release the plan. Everything
+ * else above stderr is closed, save for descriptors kept by `exec` or
+ * redirected for a subshell, so that a program does not inherit
+ * descriptors the shell has leaked. */
+void applyplan(fdplan_t *plan) {
+  moveall(plan);
+  updatekept(plan);
+  if (!sweep())
+    closeopened(plan);
+  free(plan->moves);
+  free(plan->opened);
+}
+
+/* Move descriptors into place in the shell itself for `exec` and release
+ * the plan. Descriptors above stderr are remembered, so that children don't
+ * close them. */
+void keepplan(fdplan_t *plan) {
+  for (int i = 0; i < plan->nmoves; i++)
+    releasefd(plan->moves[i].fd);
+  moveall(plan);
+  updatekept(plan);
+  closeopened(plan);
+  free(plan->moves);
+  free(plan->opened);
+}
+
+/* Pass descriptor `fd` of the shell to its children under the same number,
+ * or stop doing so. Pipes of process substitutions are passed this way. */
+void sharefd(int fd, bool share) {
+  setkept(fd, share);
+  if (fcntl(fd, F_SETFD, share ? 0 : FD_CLOEXEC) < 0)
+    unix_error("fcntl error");
+}
+
+/* Close descriptors opened for the command within the shell. */
+void freeplan(fdplan_t *plan) {
+  for (int i = 0; i < plan->nopened; i++)
+    Close(plan->opened[i]);
+  free(plan->moves);
+  free(plan->opened);
+  plan->moves = NULL;
+  plan->opened = NULL;
+  plan->nmoves = plan->nopened = 0;
+}
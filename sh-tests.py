@@ -9,8 +9,10 @@ import unittest
 import subprocess
 import random
 import time
+import socket
 import sys
-from tempfile import NamedTemporaryFile
+import threading
+from tempfile import NamedTemporaryFile, TemporaryDirectory
 
 
 LOGFILE = 'sh-tests.{}.log'.format(os.getpid())
@@ -190,6 +192,45 @@ class TestShellSimple(ShellTesterSimple, unittest.TestCase):
                 self.execute('wc -l ' + inf.name + ' >' + outf.name)
                 self.assertEqual(outf.read().split()[0], str(n))
 
+    def test_redir_3(self):
+        with TemporaryDirectory() as d:
+            # truncate, append and read-write open
+            self.execute(f'cd {d}; echo abc > f; echo a > f; echo b >> f')
+            self.assertEqual(self.execute('cat f'), ['a', 'b'])
+            self.execute('echo c 1<>f')
+            self.assertEqual(self.execute('cat f'), ['c', 'b'])
+
+            # duplicating and closing descriptors
+            lines = self.execute('ls /nonexist f 2>&1 >/dev/null | wc -l')
+            self.assertEqual(lines, ['1'])
+            lines = self.execute('ls /nonexist f 3>&1 1>&2 2>&3 3>&- | wc -l')
+            self.assertEqual(lines[-1], '1')
+            lines = self.execute('cat <nonexist; echo $?')
+            self.assertEqual(lines, ['nonexist: No such file or directory', '1'])
+            lines = self.execute('echo x >&7; echo $?')
+            self.assertEqual(lines, ['7: bad file descriptor', '1'])
+
+            # kernel hints don't change contents of files
+            self.execute('IOHINTS="noatime prealloc=1M" cat <f >>g')
+            self.assertEqual(self.execute('wc -c <g'), ['4'])
+            lines = self.execute('IOHINTS=fast cat <g')
+            self.assertEqual(lines, ["IOHINTS: unknown hint 'fast'", 'c', 'b'])
+
+    def test_exec_redir(self):
+        with TemporaryDirectory() as d:
+            # descriptor 3 of the terminal must be moved out of the way
+            self.execute(f'cd {d}; exec 3>log; echo a >&3; echo b >&3')
+            lines = self.execute('ls -l /proc/%d/fd' % self.pid)
+            self.assertIn('3 -> %s/log' % d, ''.join(lines))
+            lines = self.execute('exec 3>&-; cat log | wc -l; echo c >&3')
+            self.assertEqual(lines, ['2', '3: bad file descriptor'])
+            lines = self.execute('exec 4<log; cat <&4; exec 4<&-')
+            self.assertEqual(lines, ['a', 'b'])
+
+            # children get descriptors kept by exec, but none of the others
+            lines = self.execute('exec 5>x; ls -1 /proc/self/fd; exec 5>&-')
+            self.assertEqual(lines, ['0', '1', '2', '3', '5'])
+
     def test_pipeline_1(self):
         lines = self.execute('grep LIST include/queue.h | wc -l')
         self.assertEqual(lines[0], '46')
@@ -205,6 +246,258 @@ class TestShellSimple(ShellTesterSimple, unittest.TestCase):
                     'cat < include/queue.h | grep LIST | wc -l > ' + outf.name)
             self.assertEqual(int(outf.read().split()[0]), 46)
 
+    def test_pipesize(self):
+        getsize = 'python3 -c "import fcntl; print(fcntl.fcntl(1, 1032))"'
+        lines = self.execute(f'PIPESIZE=256K {getsize} | cat')
+        self.assertEqual(lines, [str(256 << 10)])
+        lines = self.execute(f'PIPESIZE=128K; {getsize} | cat')
+        self.assertEqual(lines, [str(128 << 10)])
+        # prefix needing expansion is expanded once, by the command
+        lines = self.execute('PIPESIZE=$(echo ran >&2; echo 64K) true | cat')
+        self.assertEqual(lines, ['ran'])
+
+    def test_repeat_command(self):
+        # parsed command line is reused from cache on second run
+        for i in range(3):
+            lines = self.execute('cat < include/queue.h | grep LIST | wc -l')
+            self.assertEqual(lines[0], '46')
+
+    def test_path_search(self):
+        # found programs are forgotten when PATH changes
+        with TemporaryDirectory() as tmp:
+            for d in ['a', 'b']:
+                os.mkdir(os.path.join(tmp, d))
+                prog = os.path.join(tmp, d, 'prog')
+                with open(prog, 'w') as f:
+                    f.write('#!/bin/sh\necho %s\n' % d)
+                os.chmod(prog, 0o755)
+            self.execute('p=$PATH; f() { prog; }')
+            lines = self.execute(
+                'for d in a b; do PATH=%s/$d; prog; f; done; PATH=$p' % tmp)
+            self.assertEqual(lines, ['a', 'a', 'b', 'b'])
+            lines = self.execute('PATH=%s/b prog' % tmp)
+            self.assertEqual(lines, ['b'])
+
+    def test_builtin_output(self):
+        lines = self.execute('echo foo   bar')
+        self.assertEqual(lines, ['foo bar'])
+        lines = self.execute("printf '%s=%03d\\n' a 7 b 42")
+        self.assertEqual(lines, ['a=007', 'b=042'])
+        lines = self.execute("printf '%%%s.*d\\n' 1 2; echo $?" % ('1' * 60))
+        self.assertEqual(lines[-1], '1')
+        lines = self.execute("printf '%s\\n' a b c | wc -l")
+        self.assertEqual(lines, ['3'])
+        with NamedTemporaryFile(mode='r') as outf:
+            self.execute('echo -n hello >' + outf.name)
+            self.assertEqual(outf.read(), 'hello')
+        lines = self.execute('test 1 -eq x 2>/dev/null; echo $?; '
+                             'cd /nonexistent 2>/dev/null || echo failed; '
+                             'echo hi >/dev/full 2>/dev/null; echo $?')
+        self.assertEqual(lines, ['2', 'failed', '1'])
+
+    def test_builtin_stages(self):
+        # pure builtins in pipelines run on threads of a shell without job
+        # control and in subprocesses otherwise
+        lines = self.execute('echo one two | wc -w')
+        self.assertEqual(lines, ['2'])
+        lines = self.execute("./shell -c 'echo a b | wc -w; echo | false'; "
+                             "echo $?")
+        self.assertEqual(lines, ['2', '1'])
+        lines = self.execute('cat /dev/null | echo last')
+        self.assertEqual(lines, ['last'])
+        lines = self.execute('cat /dev/null | false; echo $?')
+        self.assertEqual(lines, ['1'])
+        lines = self.execute('echo foo | true | wc -c')
+        self.assertEqual(lines, ['0'])
+        lines = self.execute('echo | X=1 true; echo $?')
+        self.assertEqual(lines, ['0'])
+
+    def test_lastpipe(self):
+        # without job control the shell may evaluate the last stage itself
+        script = "x=old; /bin/true | x=new; echo $x; LASTPIPE=1; %s"
+        lines = self.execute("./shell -c '%s'" % (script % ''))
+        self.assertEqual(lines, ['old'])
+        lines = self.execute(
+            "./shell -c '%s'" % (script % "/bin/true | x=new; echo $x"))
+        self.assertEqual(lines, ['old', 'new'])
+        lines = self.execute(
+            "./shell -c 'LASTPIPE=1; /bin/echo a | { cat; false; }; echo $?'")
+        self.assertEqual(lines, ['a', '1'])
+        lines = self.execute(
+            "./shell -c 'LASTPIPE=1; echo a | echo b | read x; echo $x'")
+        self.assertEqual(lines, ['b'])
+
+    def test_peephole(self):
+        # debug output must not contain the whole command, see `execute`
+        self.execute('PEEPHOLE=debug')
+        lines = self.execute('cat Makefile | wc -l; true')
+        self.assertEqual(lines[0], 'peephole: cat Makefile | wc -l -> '
+                                   'wc -l <Makefile')
+        self.assertEqual(lines[1:], self.execute('wc -l <Makefile'))
+        lines = self.execute('echo abc | cat | wc -c >/dev/null >/dev/null; :')
+        self.assertEqual(lines, ['peephole: echo abc | cat | wc -c >/dev/null '
+                                 '>/dev/null -> echo abc | wc -c >/dev/null'])
+        lines = self.execute('cat /nonexistent 2>/dev/null | wc -c')
+        self.assertEqual(lines, ['0'])
+        # builtin left alone would run within the shell
+        lines = self.execute('cat Makefile | cd /; cat Makefile | exit 3; pwd')
+        self.assertEqual(lines, [os.getcwd()])
+
+    def test_tee(self):
+        with TemporaryDirectory() as d:
+            # pipes are duplicated with tee(2) and spliced into files
+            lines = self.execute(f'seq 20000 | tee {d}/a {d}/b | wc -l')
+            self.assertEqual(lines, ['20000'])
+            lines = self.execute(f'cmp {d}/a {d}/b && wc -l <{d}/a')
+            self.assertEqual(lines, ['20000'])
+            lines = self.execute(f'echo x | tee -a {d}/a >/dev/null; '
+                                 f'tail -n 1 {d}/a')
+            self.assertEqual(lines, ['x'])
+            lines = self.execute('seq 3 | tee | tail -n 1')
+            self.assertEqual(lines, ['3'])
+            # a failed output is reported and the others get all data
+            lines = self.execute(f'seq 20000 | tee /dev/full {d}/c | wc -l; '
+                                 f'wc -l <{d}/c')
+            self.assertEqual(lines, ['tee: /dev/full: No space left on device',
+                                     '20000', '20000'])
+
+    def test_procsubst(self):
+        lines = self.execute('diff <(seq 3) <(seq 3) && cat <(echo hi)')
+        self.assertEqual(lines, ['hi'])
+        lines = self.execute('f() { cat "$1"; }; f <(echo fn) | cat')
+        self.assertEqual(lines, ['fn'])
+        lines = self.execute('echo abc | tee >(wc -c) >/dev/null; jobs')
+        self.assertEqual(lines, ['4'])
+        lines = self.execute('cat < <(seq 2); cat <(exit 3) ; echo $?')
+        self.assertEqual(lines, ['1', '2', '0'])
+
+    def test_coproc(self):
+        script = ('coproc dbl sed -u "s/.*/&&/"; '
+                  'echo ab >&$dbl; read r <&$dbl; echo $r; '
+                  'echo 5 >&$dbl; read r <&$dbl; echo $r; coproc -c dbl; '
+                  # shutting down writing makes sort see end of its input
+                  'coproc srt sort; printf "b\\na\\n" >&$srt; '
+                  'coproc -s srt; while read x <&$srt; do echo $x; done')
+        lines = self.execute("./shell -c '%s'" % script)
+        self.assertEqual(lines, ['abab', '55', 'a', 'b'])
+
+    def test_socket_redir(self):
+        with TemporaryDirectory() as d:
+            server = socket.socket(socket.AF_UNIX)
+            server.bind(f'{d}/sock')
+            server.listen(1)
+            # fits into the socket buffer before the connection is accepted
+            self.execute(f'seq 1000 >{d}/f; copy <{d}/f >unix:{d}/sock')
+            conn, _ = server.accept()
+            data = b''
+            while chunk := conn.recv(4096):
+                data += chunk
+            self.assertEqual(data.count(b'\n'), 1000)
+            conn.close()
+            server.close()
+
+            server = socket.socket()
+            server.bind(('127.0.0.1', 0))
+            server.listen(1)
+            port = server.getsockname()[1]
+            conns = []
+
+            def send():
+                conns.append(server.accept()[0])
+                conns[0].sendall(b'x\ny\n')
+                conns[0].shutdown(socket.SHUT_WR)
+
+            sender = threading.Thread(target=send)
+            sender.start()
+            lines = self.execute(f'wc -l <tcp:127.0.0.1:{port}')
+            sender.join()
+            for conn in conns:
+                conn.close()
+            server.close()
+            self.assertEqual(lines, ['2'])
+
+    def test_control_flow(self):
+        lines = self.execute('for x in a b c; do echo $x; done')
+        self.assertEqual(lines, ['a', 'b', 'c'])
+        lines = self.execute('if false; then echo no; elif true; then echo yes; fi')
+        self.assertEqual(lines, ['yes'])
+        lines = self.execute('while true; do echo once; break; done')
+        self.assertEqual(lines, ['once'])
+        lines = self.execute(
+            'for x in 1 2; do for y in 3 4; do echo $x; continue 2; done; done'
+            ' | wc -l')
+        self.assertEqual(lines, ['2'])
+        lines = self.execute('! false && { echo foo; false; } || echo bar')
+        self.assertEqual(lines, ['foo', 'bar'])
+
+    def test_functions_and_aliases(self):
+        self.execute('greet() { echo hello; for x in a b; do return 3; done; }')
+        lines = self.execute('greet && echo no || echo returned')
+        self.assertEqual(lines, ['hello', 'returned'])
+        self.execute('f() { while true; do return 4; done; echo after-loop; }')
+        lines = self.execute('f; echo $?')
+        self.assertEqual(lines, ['4'])
+        lines = self.execute('greet | wc -l')
+        self.assertEqual(lines, ['1'])
+        self.execute("alias hi='greet; echo \"a  b\"'")
+        lines = self.execute('hi')
+        self.assertEqual(lines, ['hello', 'a  b'])
+        self.execute('unalias hi')
+        lines = self.execute('hi || echo gone')
+        self.assertEqual(lines[-1], 'gone')
+
+    def test_expansion(self):
+        self.execute('x=abc.tar.gz; y="a   b"')
+        lines = self.execute('echo ${x%.gz} ${x##*.} ${#x} $((3*(2+1)))')
+        self.assertEqual(lines, ['abc.tar gz 10 9'])
+        lines = self.execute('echo $y; echo "$y" \'$y\'')
+        self.assertEqual(lines, ['a b', 'a   b $y'])
+        lines = self.execute(
+            'i=0; while [ $i -lt 3 ]; do i=$((i+1)); done; echo i=$i')
+        self.assertEqual(lines, ['i=3'])
+        lines = self.execute('echo $((0 && 1/0)) '
+                             '$(( (-9223372036854775807-1) / -1 ))')
+        self.assertEqual(lines, ['0 -9223372036854775808'])
+        lines = self.execute('printenv x || echo ${z:-unset}')
+        self.assertEqual(lines, ['unset'])
+
+    def test_export(self):
+        lines = self.execute('v=1; V=2 printenv V; printenv V || echo none')
+        self.assertEqual(lines, ['2', 'none'])
+        lines = self.execute('export v; v=3; printenv v')
+        self.assertEqual(lines, ['3'])
+        lines = self.execute('unset v; printenv v || echo ${v-unset}')
+        self.assertEqual(lines, ['unset'])
+
+    def test_command_substitution(self):
+        lines = self.execute('n=$(printf "%s\\n" a b | wc -l); echo "[$n]"')
+        self.assertEqual(lines, ['[2]'])
+        lines = self.execute('echo `echo x` "$(echo "a  b")" $(echo c; exit 3)$?')
+        self.assertEqual(lines, ['x a  b c3'])
+        lines = self.execute('d=$(cd /; pwd); [ "$d" != "$(pwd)" ] && echo kept')
+        self.assertEqual(lines, ['kept'])
+
+    def test_heredoc(self):
+        self.sendline("x=world; cat <<'EOF' | tr a-z A-Z; cat <<EOF")
+        for line in ['abc $x', 'EOF', 'def $x']:
+            self.expect_exact('> ')
+            self.sendline(line)
+        self.expect_exact('> ')
+        lines = self.execute('EOF')
+        self.assertEqual(lines, ['ABC $X', 'def world'])
+        lines = self.execute('tr a-z A-Z <<<"hi $x"')
+        self.assertEqual(lines, ['HI WORLD'])
+
+    def test_globbing(self):
+        with TemporaryDirectory() as d:
+            os.mkdir(os.path.join(d, 'sub'))
+            for name in ['a.c', 'b.c', 'c.h', 'sub/d.c']:
+                open(os.path.join(d, name), 'w').close()
+            lines = self.execute(f'cd {d}; echo *.c "*.c" */*.c **/*.c x*')
+            self.assertEqual(lines, ['a.c b.c *.c sub/d.c a.c b.c sub/d.c x*'])
+            lines = self.execute('p=[ab].c; for f in $p; do echo $f; done')
+            self.assertEqual(lines, ['a.c', 'b.c'])
+
     def test_fd_leaks(self):
         # 'ls -l /proc/self/fd'
         lines = self.execute('ls -l /proc/self/fd')
@@ -363,6 +656,12 @@ class TestShellWithSyscalls(ShellTester, unittest.TestCase):
         stty_after = self.stty()
         self.assertEqual(stty_before, stty_after)
 
+    def test_typeahead(self):
+        # input typed while a foreground job runs is not discarded
+        self.sendline('sleep 0.2')
+        self.sendline('echo typed ahead')
+        self.expect_exact('typed ahead')
+
     def test_termattr_2(self):
         prog = 'more shell.c'
         stty_before = self.stty()
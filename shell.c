@@ -8,6 +8,16 @@
 
 sigset_t sigchld_mask;
 
+int exitstatus;
+int evalskip, skipcount, loopnest, funcnest;
+
+char *arg0;
+char **posparams;
+pid_t rootpid, lastbgpid;
+
+static int eval_list(node_t *n);
+static int eval_node(node_t *n);
+
 static void sigint_handler(int sig) {
   /* No-op handler, we just need break read() call with EINTR. */
   (void)sig;
@@ -22,63 +32,287 @@ static void MaybeClose(int *fdp) {
   *fdp = -1;
 }
 
-/* Consume all tokens related to redirection operators.
- * Put opened file descriptors into inputp & output respectively. */
-static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp) {
-  token_t mode = NULL; /* T_INPUT, T_OUTPUT or NULL */
-  int n = 0;           /* number of tokens after redirections are removed */
-
-  for (int i = 0; i < ntokens; i++) {
+/* Open files according to redirection plan of a stage and record where
+ * descriptors of the command come from. Pipe ends `input` and `output` are
+ * taken over by the plan. Returns false if a file name could not be expanded
+ * or a redirection failed. */
+static bool do_redir(stage_t *st, fdplan_t *plan, int input, int output,
+                     char **assigns) {
+  initplan(plan, st->nredir, input, output, assigns);
+  for (int i = 0; i < st->nredir; i++) {
     /* TODO: Handle tokens and open files as requested. */
 #ifdef STUDENT
-    /*Przechodzimy po całej liście tokenów i jeżeli napotkamy T_INPUT albo
-    T_OUTPUT to zapamiętujemy token usuwamy go z listy i traktujemy następny
-    token jako nazwę pliku.*/
-    if (token[i] == T_INPUT) {
-      mode = token[i];
-      token[i] = T_NULL;
-    } else if (token[i] == T_OUTPUT) {
-      mode = token[i];
-      token[i] = T_NULL;
-    } else {
-      if (mode != NULL) {
-        if (mode == T_INPUT) {
-          MaybeClose(inputp);
-          *inputp = Open(token[i], O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-        }
-        if (mode == T_OUTPUT) {
-          MaybeClose(outputp);
-          *outputp = Open(token[i], O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-        }
-        token[i] = T_NULL;
-        mode = NULL;
-      }
-      token[n] = token[i];
-      if (n < i) {
-        token[i] = T_NULL;
-      }
-      n += 1;
+    /*Przechodzimy po planie przekierowań i otwieramy pliki, zamykając
+    poprzednio otwarte dla tego samego strumienia.*/
+    redir_t *r = &st->redir[i];
+    char *path = needexp_p(r->path) ? expand_word(r->path) : r->path;
+    bool ok = path && addredir(plan, r, path);
+    if (path && path != r->path)
+      free(path);
+    if (!ok) {
+      freeplan(plan);
+      return false;
     }
 #endif /* !STUDENT */
   }
+  return true;
+}
+
+/* Returns true if the command is given its own PATH, e.g. `PATH=bin cmd`. */
+static bool pathassign_p(token_t *assigns) {
+  for (; assigns && *assigns; assigns++)
+    if (!strncmp(*assigns, "PATH=", 5))
+      return true;
+  return false;
+}
+
+/* Resolve program name before fork, so that next run of cached command line
+ * can execve the program directly, unless PATH changed meanwhile. Names
+ * produced by expansion may change between runs, so they are searched each
+ * time into `*tmpp`. Own PATH of the command is searched by the child. */
+static const char *resolve(stage_t *st, char **argv, char **tmpp) {
+  if (st->node || pathassign_p(st->assigns))
+    return NULL;
+  if (needexp_p(st->argv[0]))
+    return *tmpp = search_path(argv[0]);
+  if (st->path == NULL || st->pathgen != pathgen) {
+    st->path = findprogram(argv[0]);
+    st->pathgen = pathgen;
+  }
+  return st->path;
+}
+
+static int do_job(stage_t *st, bool bg);
+
+/* Assignments of a command without name are done from left to right, so each
+ * of them can refer to variables set by the previous ones. */
+static int assign(token_t *assigns) {
+  for (; assigns && *assigns; assigns++) {
+    char **entry = expand_assigns((token_t[]){*assigns, NULL});
+    if (entry == NULL)
+      return 1;
+    setvars(entry, 0);
+    freewords(entry);
+  }
+  return 0;
+}
+
+/* Call a shell function within shell's process. Function body is evaluated
+ * from the syntax tree built when the function was defined. */
+static int callfunc(function_t *fn, char **argv) {
+  /* Function may redefine itself while it's running. */
+  cmd_t *cmd = holdcmd(fn->cmd);
+  char **saved_params = posparams;
+  int saved_loopnest = loopnest;
+
+  posparams = &argv[1];
+  loopnest = 0;
+  funcnest++;
+  int status = do_job(fn->body, false);
+  funcnest--;
+  loopnest = saved_loopnest;
+  posparams = saved_params;
+
+  if (evalskip == SKIP_RETURN)
+    evalskip = SKIP_NONE;
+  freecmd(cmd);
+  return status;
+}
+
+/* Process substitution started by expansion of a command. */
+typedef struct subst {
+  pid_t pid;   /* process evaluating the substitution */
+  int fd;      /* descriptor named by /dev/fd/N */
+  bool output; /* `>(...)`, i.e. the command writes into the pipe */
+} subst_t;
+
+/* Substitutions of a command wait on a barrier until they join its job,
+ * so they can't finish before the job knows of them. */
+typedef struct substs {
+  subst_t *subst;
+  int nsubsts;
+  int barrier[2];
+  int job;    /* job of substitutions of a command evaluated by the shell */
+  pid_t pgid; /* process group of that job */
+} substs_t;
+
+#define NOSUBSTS ((substs_t){.barrier = {-1, -1}, .job = -1})
+
+static substs_t pending = NOSUBSTS;
+
+/* Take substitutions started by expansions done so far. Nested commands,
+ * e.g. of a function, start with none. */
+static substs_t takesubsts(void) {
+  substs_t s = pending;
+  pending = NOSUBSTS;
+  return s;
+}
+
+/* Children forget substitutions of the parent, as they are not theirs. */
+static void forgetsubsts(void) {
+  free(pending.subst);
+  pending = NOSUBSTS;
+}
+
+/* Make processes of substitutions members of job `j` led by `pgid`. Within
+ * job of a command they're added before it, as status of the job is the status
+ * of its last process, and are not shown in its text. Must be called with
+ * SIGCHLD blocked. */
+static void adoptsubsts(substs_t *s, int j, pid_t pgid, bool own) {
+  for (int i = 0; i < s->nsubsts; i++) {
+    char *name = s->subst[i].output ? ">(...)" : "<(...)";
+    joinpgrp(s->subst[i].pid, pgid);
+    addproc(j, s->subst[i].pid, own ? (char *[]){name, NULL} : NULL);
+  }
+}
 
-  token[n] = NULL;
-  return n;
+/* Substitutions of a command evaluated by the shell make up a job of their
+ * own. It's kept out of foreground slot, which the command may need. Its
+ * processes form a new process group or stay in the caller's one. */
+static void startsubsts(substs_t *s, bool newgrp) {
+  if (s->nsubsts == 0)
+    return;
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  s->pgid = newgrp ? s->subst[0].pid : getpgrp();
+  s->job = addjob(s->pgid, BG);
+  adoptsubsts(s, s->job, s->pgid, true);
+  releasebarrier(s->barrier);
+  s->barrier[0] = s->barrier[1] = -1;
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+static void sharesubsts(substs_t *s, bool share) {
+  for (int i = 0; i < s->nsubsts; i++)
+    sharefd(s->subst[i].fd, share);
+}
+
+/* Close pipes of substitutions in the shell. Processes that haven't joined
+ * a job, as the command failed to start, run unattended. */
+static void freesubsts(substs_t *s) {
+  for (int i = 0; i < s->nsubsts; i++)
+    Close(s->subst[i].fd);
+  releasebarrier(s->barrier);
+  free(s->subst);
+  int j = s->job;
+  pid_t pgid = s->pgid;
+  *s = NOSUBSTS;
+  s->job = j;
+  s->pgid = pgid;
+}
+
+/* Wait for the job made by `startsubsts`. */
+static void waitsubsts(substs_t *s) {
+  if (s->job < 0)
+    return;
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  waitjob(s->job, s->pgid, &mask);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/* Evaluate compound command or function in a forked child. Its children are
+ * not subject to job control, since they belong to the child's job. */
+static noreturn void subshell(stage_t *st, char **argv, function_t *fn,
+                              sigset_t *mask) {
+  initsubshell();
+  Sigprocmask(SIG_SETMASK, mask, NULL);
+  exit(fn ? callfunc(fn, argv) : eval_node(st->node));
+}
+
+/* Compound commands without redirections are evaluated by the shell itself,
+ * otherwise like external commands they need a subprocess. */
+static bool inprocess_p(stage_t *st, bool bg) {
+  return st->node && !bg && st->nredir == 0 && st->node->type != N_SUBSHELL;
 }
 
 /* Execute internal command within shell's process or execute external command
  * in a subprocess. External command can be run in the background. */
-static int do_job(token_t *token, int ntokens, bool bg) {
-  int input = -1, output = -1;
+static int do_job(stage_t *st, bool bg) {
+  token_t *token = st->argv;
+  fdplan_t plan;
   int exitcode = 0;
+  builtin_t builtin = NULL;
+  function_t *fn = NULL;
+  const char *path = NULL;
+  char *tmppath = NULL;
+  char **assigns = NULL;
+  substs_t subst = NOSUBSTS;
+
+  if (inprocess_p(st, bg))
+    return eval_node(st->node);
+
+  if (st->expand && !(token = expand_words(st->argv)))
+    return 1;
 
-  ntokens = do_redir(token, ntokens, &input, &output);
+  if (token[0] == NULL) {
+    /* Only assignments or all words expanded to nothing. Assignments give
+     * status of the last command substitution they performed. */
+    exitstatus = 0;
+    exitcode = assign(st->assigns);
+    if (!exitcode && do_redir(st, &plan, -1, -1, NULL)) {
+      exitcode = exitstatus;
+      freeplan(&plan);
+    } else {
+      exitcode = 1;
+    }
+    goto done;
+  }
 
-  if (!bg) {
-    if ((exitcode = builtin_command(token)) >= 0)
-      return exitcode;
+  if (st->assigns && !(assigns = expand_assigns(st->assigns))) {
+    exitcode = 1;
+    goto done;
   }
 
+  int flags = 0;
+  int kind = st->node ? C_EXTERNAL : lookup(token[0], &builtin, &flags, &fn);
+
+  if (kind == C_FUNCTION && !bg && st->nredir == 0) {
+    subst = takesubsts();
+    startsubsts(&subst, true);
+    sharesubsts(&subst, true);
+    varsave_t *saved = assigns ? pushvars(assigns) : NULL;
+    exitcode = callfunc(fn, token);
+    if (saved)
+      popvars(saved);
+    sharesubsts(&subst, false);
+    freesubsts(&subst);
+    waitsubsts(&subst);
+    goto done;
+  }
+
+  if (!do_redir(st, &plan, -1, -1, assigns)) {
+    exitcode = 1;
+    goto done;
+  }
+  subst = takesubsts();
+
+  if (kind == C_BUILTIN && !bg) {
+    startsubsts(&subst, true);
+    if (flags & B_KEEPREDIR) {
+      keepplan(&plan);
+      initplan(&plan, 0, -1, -1, NULL);
+    }
+    io_t io = {
+      .in = planfd(&plan, STDIN_FILENO),
+      .out = planfd(&plan, STDOUT_FILENO),
+      .err = planfd(&plan, STDERR_FILENO),
+    };
+    varsave_t *saved = assigns ? pushvars(assigns) : NULL;
+    exitcode = builtin(&token[1], &io);
+    if (saved)
+      popvars(saved);
+    freeplan(&plan);
+    freesubsts(&subst);
+    /* Substitution read by a descriptor kept by `exec` may never end. */
+    if (!(flags & B_KEEPREDIR))
+      waitsubsts(&subst);
+    goto done;
+  }
+
+  if (kind == C_EXTERNAL)
+    path = resolve(st, token, &tmppath);
+
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
 
@@ -86,65 +320,124 @@ static int do_job(token_t *token, int ntokens, bool bg) {
 #ifdef STUDENT
   pid_t pid;
   int j;
+  int barrier[2];
+  initbarrier(barrier, !bg);
+  sharesubsts(&subst, true);
   if (!(pid = Fork())) { // child
-    /*Ze względu na to jak działa wrapper to setpgid musimy sprawdzać czy grupa
-    nie jest już ustawiona,
-    gdyż jeżeli spróbujemy to zrobić dwa razy dostaniemy error od wrappera*/
-    if (getpgid(getpid()) != getpid()) {
-      Setpgid(0, 0);
-    }
     /*Jeżeli odpalamy program jako pierwszoplanowy to każemy mu poczekać do
      * momentu w którym nie oddamy mu terminala*/
-    if (!bg) {
-      sigsuspend(&mask);
-    }
+    waitbarrier(barrier, 0);
     /*execve przywraca domyślną dyspozycję flag które nie były ignorowane w
      * rodzicu*/
-    Signal(SIGTSTP, SIG_DFL);
-    Signal(SIGTTIN, SIG_DFL);
-    Signal(SIGTTOU, SIG_DFL);
-    if (input != -1) {
-      dup2(input, STDIN_FILENO);
-      MaybeClose(&input);
-    }
-    if (output != -1) {
-      dup2(output, STDOUT_FILENO);
-      MaybeClose(&output);
+    resetsignals(bg);
+    /* Programs must not inherit blocked SIGCHLD. */
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    applyplan(&plan);
+    if (assigns && kind != C_EXTERNAL)
+      setvars(assigns, V_EXPORT);
+    if (st->node || fn)
+      subshell(st, token, fn, &mask);
+    if (builtin) {
+      io_t io = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+      exit(builtin(&token[1], &io));
     }
-    external_command(token);
+    external_command(token, path, assigns);
   }
-  if (getpgid(pid) != pid) {
-    Setpgid(pid, pid);
-  }
-  MaybeClose(&input);
-  MaybeClose(&output);
+  joinpgrp(pid, 0);
+  freeplan(&plan);
+  sharesubsts(&subst, false);
   // Tworzymy nowe zadanie i jeżeli jest pierwszoplanowe to je monitorujemy, w
   // przeciwnym wypadku wypisujemy tylko komunikat
   j = addjob(pid, bg);
+  adoptsubsts(&subst, j, pid, false);
   addproc(j, pid, token);
   if (bg) {
-    printf("[%d] running '%s'\n", j, jobcmd(j));
+    freesubsts(&subst);
+    lastbgpid = pid;
+    if (jobctl)
+      printf("[%d] running '%s'\n", j, jobcmd(j));
   } else if (!bg) {
-
     setfgpgrp(pid);
-    /*Wysyłamy dziecku sygnał dając mu znać że może kontynuować*/
-    Kill(-pid, SIGCHLD);
+    freesubsts(&subst);
+    /*Dajemy dziecku znać że może kontynuować*/
+    releasebarrier(barrier);
     exitcode = monitorjob(&mask);
   }
 #endif /* !STUDENT */
 
   Sigprocmask(SIG_SETMASK, &mask, NULL);
+  free(tmppath);
+done:
+  freesubsts(&subst);
+  subst = takesubsts();
+  freesubsts(&subst);
+  if (token != st->argv)
+    freewords(token);
+  if (assigns)
+    freewords(assigns);
   return exitcode;
 }
 
+/* Start coprocess `argv` as a background job, whose standard input and output
+ * are both connected to `channel`. Returns process id of the coprocess. */
+pid_t startcoproc(char **argv, int channel) {
+  builtin_t builtin = NULL;
+  function_t *fn = NULL;
+  char *path = NULL;
+  if (lookup(argv[0], &builtin, NULL, &fn) == C_EXTERNAL)
+    path = search_path(argv[0]);
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  pid_t pid = Fork();
+  if (pid == 0) {
+    joinpgrp(0, 0);
+    resetsignals(true);
+    initsubshell();
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    fdplan_t plan;
+    initplan(&plan, 0, channel, Dup(channel), NULL);
+    applyplan(&plan);
+    if (fn)
+      exit(callfunc(fn, argv));
+    if (builtin) {
+      io_t io = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+      exit(builtin(&argv[1], &io));
+    }
+    external_command(argv, path, NULL);
+  }
+  joinpgrp(pid, 0);
+  free(path);
+
+  int j = addjob(pid, BG);
+  addproc(j, pid, argv);
+  lastbgpid = pid;
+  if (jobctl)
+    printf("[%d] running '%s'\n", j, jobcmd(j));
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return pid;
+}
+
 /* Start internal or external command in a subprocess that belongs to pipeline.
  * All subprocesses in pipeline must belong to the same process group. */
-static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
-                      token_t *token, int ntokens, bool bg) {
-  ntokens = do_redir(token, ntokens, &input, &output);
+static pid_t do_stage(pid_t pgid, sigset_t *mask, int *barrier, int input,
+                      int output, stage_t *st, bool bg) {
+  token_t *token = st->argv;
+  builtin_t builtin = NULL;
+  function_t *fn = NULL;
+  const char *path = NULL;
+  char *tmppath = NULL;
+  char **assigns = NULL;
+  int kind = C_EXTERNAL;
 
-  if (ntokens == 0)
-    app_error("ERROR: Command line is not well formed!");
+  /* Words that need expansion are expanded by the child. */
+  if (!st->node && !st->expand && token[0]) {
+    kind = lookup(token[0], &builtin, NULL, &fn);
+    if (kind == C_EXTERNAL)
+      path = resolve(st, token, &tmppath);
+  }
 
   /* TODO: Start a subprocess and make sure it's moved to a process group. */
   pid_t pid = Fork();
@@ -153,69 +446,182 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
   trzeba przypisać dziecko,a jeżeli jest on równy zero to jest on pierwszym
   procesem w grupie */
   if (!pid) {
-    if (pgid == 0) {
-      if (getpgid(getpid()) != getpid()) {
-        Setpgid(0, 0);
-      }
-    } else {
-      if (pgid != getpid()) {
-        Setpgid(getpid(), pgid);
-      }
-    }
-    if (!bg) {
-      sigsuspend(mask);
-    }
-    Signal(SIGTSTP, SIG_DFL);
-    Signal(SIGTTIN, SIG_DFL);
-    Signal(SIGTTOU, SIG_DFL);
-    if (input != -1) {
-      dup2(input, STDIN_FILENO);
-      MaybeClose(&input);
+    waitbarrier(barrier, pgid);
+    resetsignals(bg);
+    /* Expansions below may need to run command substitutions. */
+    initsubshell();
+    Sigprocmask(SIG_SETMASK, mask, NULL);
+    fdplan_t plan;
+    if (st->expand && !(token = expand_words(st->argv)))
+      exit(1);
+    if (token[0] == NULL) {
+      int status = assign(st->assigns);
+      exit(status || !do_redir(st, &plan, input, output, NULL));
     }
-    if (output != -1) {
-      dup2(output, STDOUT_FILENO);
-      MaybeClose(&output);
+    if (st->assigns && !(assigns = expand_assigns(st->assigns)))
+      exit(1);
+    if (!do_redir(st, &plan, input, output, assigns))
+      exit(1);
+    /* Substitutions are children of the stage, hence members of its job.
+     * Stage that doesn't execute a program waits for them. */
+    substs_t subst = takesubsts();
+    sharesubsts(&subst, true);
+    startsubsts(&subst, false);
+    applyplan(&plan);
+    if (st->expand) {
+      kind = lookup(token[0], &builtin, NULL, &fn);
+      if (kind == C_EXTERNAL)
+        path = resolve(st, token, &tmppath);
     }
-    if (!bg) {
-      if (builtin_command(token) >= 0) {
-        exit(EXIT_SUCCESS);
-      }
-    }
-    external_command(token);
-  }
-  if (pgid == 0) {
-    if (getpgid(pid) != pid) {
-      Setpgid(pid, pid);
-    }
-  } else {
-    if (pgid != pid) {
-      Setpgid(pid, pgid);
+    if (assigns && kind != C_EXTERNAL)
+      setvars(assigns, V_EXPORT);
+    if (!st->node && !fn && !builtin)
+      external_command(token, path, assigns);
+    int status;
+    if (builtin) {
+      io_t io = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+      status = builtin(&token[1], &io);
+    } else {
+      status = fn ? callfunc(fn, token) : eval_node(st->node);
     }
+    freesubsts(&subst);
+    waitsubsts(&subst);
+    if (assigns)
+      freewords(assigns);
+    if (token != st->argv)
+      freewords(token);
+    exit(status);
   }
+  free(tmppath);
+  joinpgrp(pid, pgid);
 #endif /* !STUDENT */
 
   return pid;
 }
 
-static void mkpipe(int *readp, int *writep) {
-  int fds[2];
-  Pipe(fds);
-  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
-  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
-  *readp = fds[0];
-  *writep = fds[1];
+/* Returns builtin that makes up the stage, if it can be run within shell's
+ * process, i.e. it doesn't change state of the shell. */
+static builtin_t purestage(stage_t *st) {
+  if (st->node || st->nredir > 0 || st->assigns || needexp_p(st->argv[0]))
+    return NULL;
+
+  builtin_t builtin = NULL;
+  function_t *fn = NULL;
+  int flags = 0;
+  if (lookup(st->argv[0], &builtin, &flags, &fn) != C_BUILTIN ||
+      !(flags & B_PURE))
+    return NULL;
+  return builtin;
+}
+
+/* Builtin stage of a pipeline evaluated by a thread of the shell. */
+typedef struct bstage {
+  thread_t *thread;
+  builtin_t builtin;
+  char **argv; /* private copy, as the command may be freed meanwhile */
+  io_t io;
+} bstage_t;
+
+static void *bstage_main(void *arg) {
+  bstage_t *bs = arg;
+  int status = W_EXITCODE(bs->builtin(&bs->argv[1], &bs->io), 0);
+  if (bs->io.in != STDIN_FILENO)
+    Close(bs->io.in);
+  if (bs->io.out != STDOUT_FILENO)
+    Close(bs->io.out);
+  freewords(bs->argv);
+
+  /* Report the stage as killed by SIGPIPE it would have received. */
+  sigset_t pending;
+  if (sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE))
+    status = W_EXITCODE(0, SIGPIPE);
+  exitthread(bs->thread, status);
+  free(bs);
+  return NULL;
+}
+
+/* Returns builtin of a pipeline stage that may run on a thread. Threads are
+ * not used under job control: a thread can't be stopped with the rest of its
+ * job and it's not in the foreground process group, so reading the terminal
+ * would fail. Even `echo` may block on a full pipe to a stopped consumer. */
+static builtin_t threadstage(stage_t *st) {
+  return jobctl || st->expand ? NULL : purestage(st);
+}
+
+/* Start builtin stage of a pipeline on a thread, which saves a fork. Thread
+ * takes over pipe ends `input` and `output`. Returns identifier of the thread
+ * as a pseudo-process of the job. */
+static pid_t do_thread(stage_t *st, builtin_t builtin, int input, int output) {
+  bstage_t *bs = malloc(sizeof(bstage_t));
+  bs->thread = addthread();
+  bs->builtin = builtin;
+  bs->io = (io_t){input < 0 ? STDIN_FILENO : input,
+                  output < 0 ? STDOUT_FILENO : output, STDERR_FILENO};
+
+  int n = 0;
+  while (st->argv[n])
+    n++;
+  bs->argv = malloc(sizeof(char *) * (n + 1));
+  for (int i = 0; i <= n; i++)
+    bs->argv[i] = st->argv[i] ? strdup(st->argv[i]) : NULL;
+
+  /* Signals are handled by the main thread only. A write to a closed pipe
+   * makes the builtin fail with EPIPE instead. */
+  pthread_attr_t attr;
+  sigset_t all;
+  sigfillset(&all);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setsigmask_np(&attr, &all);
+
+  pid_t pid = bs->thread->pid;
+  pthread_t tid;
+  Pthread_create(&tid, &attr, bstage_main, bs);
+  pthread_attr_destroy(&attr);
+  return pid;
+}
+
+/* With LASTPIPE set and job control disabled, the last stage of a foreground
+ * pipeline is evaluated by the shell, so variables it sets remain visible. */
+static bool lastpipe_p(bool bg) {
+  const char *lastpipe = getvar("LASTPIPE");
+  return !bg && !jobctl && lastpipe && *lastpipe;
 }
 
-/* Pipeline execution creates a multiprocess job. Both internal and external
- * commands are executed in subprocesses. */
-static int do_pipeline(token_t *token, int ntokens, bool bg) {
+/* Evaluate the last stage of a pipeline within shell's process. Standard
+ * input is replaced by `input` for the duration and `input` gets closed. */
+static int do_laststage(stage_t *st, int input, sigset_t *mask) {
+  int saved = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+  Dup2(input, STDIN_FILENO);
+  Close(input);
+
+  Sigprocmask(SIG_SETMASK, mask, NULL);
+  int exitcode = do_job(st, false);
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+
+  if (saved < 0) {
+    Close(STDIN_FILENO);
+  } else {
+    Dup2(saved, STDIN_FILENO);
+    Close(saved);
+  }
+  return exitcode;
+}
+
+/* Pipeline execution creates a multiprocess job. Without job control builtins
+ * that do not change state of the shell run on its threads, other commands
+ * are executed in subprocesses. At least one subprocess leads process group
+ * of the job. Optionally the last stage is left to the shell, see
+ * `lastpipe_p`, and then the stage before it is forked if none was yet. */
+static int do_pipeline(node_t *n, bool bg) {
   pid_t pid, pgid = 0;
   int job = -1;
   int exitcode = 0;
 
   int input = -1, output = -1, next_input = -1;
+  int size = pipesize(n->stage[0].assigns);
 
-  mkpipe(&next_input, &output);
+  mkpipe(&next_input, &output, size);
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
@@ -223,46 +629,63 @@ static int do_pipeline(token_t *token, int ntokens, bool bg) {
   /* TODO: Start pipeline subprocesses, create a job and monitor it.
    * Remember to close unused pipe ends! */
 #ifdef STUDENT
-  int pocz = -1;
-  /*pocz to indeks od którego zaczyna się proces składowy całego pipe-a*/
-  for (int i = 0; i < ntokens; i++) {
-    if (pocz == -1) {
-      pocz = i;
-    }
-    /*Jeżeli napotkamy token T_PIPE oznacz to że mamy już wszystko co potrzeba
-     * do odpalania jednego procesu składowego*/
-    if (token[i] == T_PIPE) {
-      if (pgid == 0) {
-        pid = do_stage(pgid, &mask, input, output, token + pocz, i - pocz, bg);
-        pgid = pid;
-        job = addjob(pid, bg);
-        addproc(job, pid, token + pocz);
-        /*Jeżeli jest to pierwszy proces zamykamy write-end pipe-a oraz
-         * ewentualnie input*/
-        MaybeClose(&output);
-        MaybeClose(&input);
-        pocz = -1;
-      } else {
-        /*Jeżeli nie jest to pierwszy proce to zamykamy read-end poprzedniego
-         * pipe-a i write-end aktualnego pipe-a*/
-        pid = do_stage(pgid, &mask, input, output, token + pocz, i - pocz, bg);
-        addproc(job, pid, token + pocz);
-        MaybeClose(&input);
-        MaybeClose(&output);
-        pocz = -1;
-      }
-      input = next_input;
-      mkpipe(&next_input, &output);
+  int last = n->nstages - 1;
+  int barrier[2];
+  pid_t *pids = malloc(sizeof(pid_t) * n->nstages);
+  builtin_t builtin;
+  bool lastpipe = lastpipe_p(bg);
+  initbarrier(barrier, !bg);
+  /*Odpalamy po kolei wszystkie procesy składowe oprócz ostatniego*/
+  for (int i = 0; i < last; i++) {
+    stage_t *st = &n->stage[i];
+    bool leader = lastpipe && pgid == 0 && i == last - 1;
+    if (!leader && (builtin = threadstage(st))) {
+      pids[i] = do_thread(st, builtin, input, output);
+      input = output = -1;
+    } else {
+      pids[i] = do_stage(pgid, &mask, barrier, input, output, st, bg);
+      if (pgid == 0)
+        pgid = pids[i];
     }
+    /*Zamykamy read-end poprzedniego pipe-a i write-end aktualnego pipe-a*/
+    MaybeClose(&input);
+    MaybeClose(&output);
+    input = next_input;
+    if (i + 1 < last)
+      mkpipe(&next_input, &output, size);
+    else
+      next_input = -1;
+  }
+  stage_t *st = &n->stage[last];
+  if (lastpipe) {
+    /* Without job control the group only marks the slot of the job. */
+    pid = 0;
+  } else if (pgid != 0 && (builtin = threadstage(st))) {
+    pids[last] = pid = do_thread(st, builtin, input, -1);
+    input = -1;
+  } else {
+    pids[last] = pid = do_stage(pgid, &mask, barrier, input, -1, st, bg);
+    MaybeClose(&input);
+    if (pgid == 0)
+      pgid = pid;
   }
-  pid = do_stage(pgid, &mask, input, -1, token + pocz, ntokens - pocz, bg);
-  MaybeClose(&input);
   MaybeClose(&next_input);
   MaybeClose(&output);
-  addproc(job, pid, token + pocz);
-  if (!bg) {
+  /*Zadanie tworzymy gdy znamy już jego grupę procesów*/
+  job = addjob(pgid, bg || lastpipe);
+  for (int i = 0; i < (lastpipe ? last : last + 1); i++)
+    addproc(job, pids[i], n->stage[i].argv);
+  free(pids);
+  if (bg) {
+    /* A thread has no process id, so the leader stands for it. */
+    lastbgpid = pid > 0 ? pid : pgid;
+  } else if (lastpipe) {
+    /* Other stages run in background, so the last one may start jobs. */
+    exitcode = do_laststage(st, input, &mask);
+    waitjob(job, pgid, &mask);
+  } else {
     setfgpgrp(pgid);
-    Kill(-pgid, SIGCHLD);
+    releasebarrier(barrier);
     exitcode = monitorjob(&mask);
   }
 #endif /* !STUDENT */
@@ -271,32 +694,355 @@ static int do_pipeline(token_t *token, int ntokens, bool bg) {
   return exitcode;
 }
 
-static bool is_pipeline(token_t *token, int ntokens) {
-  for (int i = 0; i < ntokens; i++)
-    if (token[i] == T_PIPE)
-      return true;
-  return false;
+#define SUBST_PIPESIZE (1 << 20) /* pipe buffer of command substitution */
+#define SUBST_READSIZE 65536     /* minimum space for a single read */
+
+/* Returns builtin that makes up the whole command substitution, if it can be
+ * run within shell's process, i.e. it doesn't change state of the shell. */
+static builtin_t purebuiltin(node_t *n) {
+  if (n == NULL || n->next || n->bg || n->negate || n->type != N_PIPELINE ||
+      n->nstages > 1)
+    return NULL;
+  return purestage(&n->stage[0]);
+}
+
+/* Builtin writes into a memory file, which is read back at once. */
+static char *subst_builtin(stage_t *st, builtin_t builtin, size_t *lenp) {
+  char **argv = st->expand ? expand_words(st->argv) : st->argv;
+  if (argv == NULL)
+    return NULL;
+
+  int fd = memfile("cmdsubst");
+  io_t io = {STDIN_FILENO, fd, STDERR_FILENO};
+  exitstatus = builtin(&argv[1], &io);
+
+  size_t len = Lseek(fd, 0, SEEK_CUR);
+  char *output = malloc(len + 1);
+  if (len > 0 && pread(fd, output, len, 0) != (ssize_t)len)
+    unix_error("pread error");
+  Close(fd);
+
+  if (argv != st->argv)
+    freewords(argv);
+  *lenp = len;
+  return output;
 }
 
-static void eval(char *cmdline) {
-  bool bg = false;
-  int ntokens;
-  token_t *token = tokenize(cmdline, &ntokens);
+/* Other commands are evaluated by a subshell, that writes into a pipe.
+ * Enlarged pipe buffer lets it run with fewer context switches and output
+ * is read into a growing buffer with as few reads as possible. */
+static char *subst_subshell(node_t *n, size_t *lenp) {
+  int input, output;
+  mkpipe(&input, &output, SUBST_PIPESIZE);
 
-  if (ntokens > 0 && token[ntokens - 1] == T_BGJOB) {
-    token[--ntokens] = NULL;
-    bg = true;
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  pid_t pid = Fork();
+  if (pid == 0) {
+    initsubshell();
+    forgetsubsts();
+    Signal(SIGINT, SIG_DFL);
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    fdplan_t plan;
+    initplan(&plan, 0, -1, output, NULL);
+    applyplan(&plan);
+    exit(eval_list(n));
   }
+  Close(output);
 
-  if (ntokens > 0) {
-    if (is_pipeline(token, ntokens)) {
-      do_pipeline(token, ntokens, bg);
-    } else {
-      do_job(token, ntokens, bg);
+  int j = addjob(pid, FG);
+  addproc(j, pid, (char *[]){"$(...)", NULL});
+
+  size_t len = 0, size = 0;
+  char *buf = NULL;
+  ssize_t nread;
+  do {
+    if (size - len < SUBST_READSIZE) {
+      size = size ? size * 2 : SUBST_READSIZE;
+      buf = realloc(buf, size + 1);
     }
+    nread = read(input, buf + len, size - len);
+    if (nread < 0 && errno != EINTR)
+      unix_error("Read error");
+    if (nread > 0)
+      len += nread;
+  } while (nread != 0);
+  Close(input);
+
+  exitstatus = monitorjob(&mask);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  *lenp = len;
+  return buf;
+}
+
+/* Run command substitution and return its output with trailing newlines
+ * removed, or NULL if the command could not be parsed or expanded. */
+char *cmdsubst(const char *text) {
+  int status;
+  cmd_t *cmd = getcmd(text, &status);
+
+  if (cmd == NULL) {
+    if (status == P_INCOMPLETE)
+      msg("syntax error: unexpected end of command substitution\n");
+    exitstatus = 2;
+    return NULL;
   }
 
-  free(token);
+  holdcmd(cmd);
+  builtin_t builtin = purebuiltin(cmd->root);
+  size_t len = 0;
+  char *output;
+  if (cmd->root == NULL)
+    output = malloc(1);
+  else if (builtin)
+    output = subst_builtin(&cmd->root->stage[0], builtin, &len);
+  else
+    output = subst_subshell(cmd->root, &len);
+  freecmd(cmd);
+
+  if (output == NULL)
+    return NULL;
+  while (len > 0 && output[len - 1] == '\n')
+    len--;
+  output[len] = '\0';
+  return output;
+}
+
+/* Start process substitution, that reads from or writes into a pipe. Returns
+ * the shell's end of the pipe, or -1 if the command could not be parsed.
+ * The process waits until the command it was expanded for joins a job. */
+int procsubst(const char *text, bool output) {
+  int status;
+  cmd_t *cmd = getcmd(text, &status);
+
+  if (cmd == NULL) {
+    if (status == P_INCOMPLETE)
+      msg("syntax error: unexpected end of process substitution\n");
+    exitstatus = 2;
+    return -1;
+  }
+
+  holdcmd(cmd);
+  int rd, wr;
+  mkpipe(&rd, &wr, 0);
+  if (pending.nsubsts == 0)
+    mkpipe(&pending.barrier[0], &pending.barrier[1], 0);
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  pid_t pid = Fork();
+  if (pid == 0) {
+    waitbarrier(pending.barrier, 0);
+    forgetsubsts();
+    initsubshell();
+    resetsignals(false);
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    fdplan_t plan;
+    initplan(&plan, 0, output ? rd : -1, output ? -1 : wr, NULL);
+    applyplan(&plan);
+    exit(cmd->root ? eval_list(cmd->root) : 0);
+  }
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  freecmd(cmd);
+
+  /* Keep the pipe out of the way of redirections, e.g. `exec 3< <(cmd)`. */
+  int fd = fcntl(output ? wr : rd, F_DUPFD_CLOEXEC, 10);
+  if (fd < 0)
+    unix_error("fcntl error");
+  Close(rd);
+  Close(wr);
+  pending.subst =
+    realloc(pending.subst, sizeof(subst_t) * (pending.nsubsts + 1));
+  pending.subst[pending.nsubsts++] = (subst_t){pid, fd, output};
+  return fd;
+}
+
+/* Called by a loop after its body was interrupted by break, continue or
+ * return. Returns true if the loop should go on with next iteration. Return
+ * leaves every loop of the function, so it's cleared by `callfunc`. */
+static bool skiploop(void) {
+  if (evalskip == SKIP_RETURN)
+    return false;
+  if (--skipcount > 0)
+    return false;
+  int skip = evalskip;
+  evalskip = SKIP_NONE;
+  return skip == SKIP_CONT;
+}
+
+/* Body of a loop is parsed once and evaluated in each iteration. */
+static int eval_loop(node_t *n) {
+  int status = 0;
+
+  loopnest++;
+  while (true) {
+    int cond = eval_list(n->left);
+    if (evalskip) {
+      if (skiploop())
+        continue;
+      break;
+    }
+    if ((cond == 0) != (n->type == N_WHILE))
+      break;
+    status = eval_list(n->right);
+    if (evalskip && !skiploop())
+      break;
+  }
+  loopnest--;
+
+  return status;
+}
+
+static int eval_for(node_t *n) {
+  char **words = n->words ? expand_words(n->words) : posparams;
+  int status = 0;
+
+  if (words == NULL)
+    return 1;
+
+  loopnest++;
+  for (int i = 0; words[i]; i++) {
+    setvar(n->var, words[i], 0);
+    status = eval_list(n->right);
+    if (evalskip && !skiploop())
+      break;
+  }
+  loopnest--;
+
+  if (words != posparams)
+    freewords(words);
+  return status;
+}
+
+/* Pipeline is evaluated after rewrites done by `peephole`. */
+static int eval_pipeline(node_t *n, bool bg) {
+  node_t *p = peephole(n);
+  int status;
+  if (p->nstages > 1)
+    status = do_pipeline(p, bg);
+  else
+    status = do_job(&p->stage[0], bg);
+  if (p != n)
+    freepeephole(n, p);
+  return status;
+}
+
+/* Evaluate a single element of command list, ignoring whether it should be
+ * run in background. Only pipelines with more than one stage fork. */
+static int eval_node(node_t *n) {
+  int status = 0;
+
+  switch (n->type) {
+    case N_PIPELINE:
+      status = eval_pipeline(n, false);
+      /* Command may have changed contents of directories. */
+      flushdirs();
+      if (n->negate)
+        status = !status;
+      break;
+    case N_AND:
+    case N_OR:
+      status = eval_node(n->left);
+      if (!evalskip && (status == 0) == (n->type == N_AND))
+        status = eval_node(n->right);
+      break;
+    case N_IF:
+      if (eval_list(n->left) == 0) {
+        if (!evalskip)
+          status = eval_list(n->right);
+      } else if (n->orelse && !evalskip) {
+        status = eval_list(n->orelse);
+      }
+      break;
+    case N_WHILE:
+    case N_UNTIL:
+      status = eval_loop(n);
+      break;
+    case N_FOR:
+      status = eval_for(n);
+      break;
+    case N_GROUP:
+    case N_SUBSHELL:
+      status = eval_list(n->right);
+      break;
+    case N_FUNCDEF:
+      deffunc(n->var, n->stage, n->cmd);
+      break;
+  }
+
+  exitstatus = status;
+  return status;
+}
+
+/* Background and-or list is evaluated by a subshell, which is put under
+ * job control like a compound command. */
+static int eval_bg(node_t *n) {
+  if (n->type == N_PIPELINE)
+    return eval_pipeline(n, true);
+
+  node_t *first = n;
+  while (first->type != N_PIPELINE)
+    first = first->left;
+
+  stage_t st = {.argv = first->stage[0].argv, .node = n};
+  return do_job(&st, true);
+}
+
+static int eval_list(node_t *n) {
+  for (; n != NULL && !evalskip; n = n->next)
+    exitstatus = n->bg ? eval_bg(n) : eval_node(n);
+  return exitstatus;
+}
+
+/* Returns P_INCOMPLETE if more lines are needed to complete the command. */
+static int eval(const char *text) {
+  int status;
+  cmd_t *cmd = getcmd(text, &status);
+
+  if (cmd == NULL) {
+    if (status == P_ERROR)
+      exitstatus = 2;
+    return status;
+  }
+
+  /* Command may be evicted from the cache while it's being evaluated. */
+  holdcmd(cmd);
+  eval_list(cmd->root);
+  evalskip = SKIP_NONE;
+  freecmd(cmd);
+  return P_OK;
+}
+
+/* Read whole script at once. */
+static char *readscript(int fd) {
+  size_t len = 0, size = 0;
+  char *text = NULL;
+  ssize_t nread;
+
+  do {
+    if (len + MAXLINE >= size) {
+      size = size * 2 + MAXLINE;
+      text = realloc(text, size);
+    }
+    nread = Read(fd, text + len, size - len - 1);
+    len += nread;
+  } while (nread > 0);
+
+  text[len] = '\0';
+  return text;
+}
+
+/* Hand out script line by line, as if it was typed in. */
+static char *nextline(char **scriptp) {
+  char *s = *scriptp;
+  if (*s == '\0')
+    return NULL;
+  size_t len = strcspn(s, "\n");
+  *scriptp = s + len + (s[len] == '\n');
+  return strndup(s, len);
 }
 
 #ifndef READLINE
@@ -323,51 +1069,96 @@ static char *readline(const char *prompt) {
 }
 #endif
 
+/* Usage: shell [-c command [name [args...]] | script [args...]]
+ * Without arguments commands are read from standard input, which makes the
+ * shell interactive if it's attached to a terminal. */
 int main(int argc, char *argv[]) {
-  /* `stdin` should be attached to terminal running in canonical mode */
-  if (!isatty(STDIN_FILENO))
-    app_error("ERROR: Shell can run only in interactive mode!");
+  char *script = NULL; /* unread part of script, NULL if interactive */
+  char *input = NULL;  /* script read from a file */
+
+  arg0 = argv[0];
+  rootpid = getpid();
+  initvars(environ);
+
+  if (argc > 2 && !strcmp(argv[1], "-c")) {
+    script = argv[2];
+    if (argc > 3)
+      arg0 = argv[3];
+    posparams = argc > 3 ? &argv[4] : &argv[argc];
+  } else if (argc > 1) {
+    int fd = Open(argv[1], O_RDONLY | O_CLOEXEC, 0);
+    script = input = readscript(fd);
+    Close(fd);
+    arg0 = argv[1];
+    posparams = &argv[2];
+  } else if (!isatty(STDIN_FILENO)) {
+    script = input = readscript(STDIN_FILENO);
+    posparams = &argv[argc];
+  } else {
+    posparams = &argv[argc];
+  }
+
+  bool interactive = (script == NULL);
 
 #ifdef READLINE
-  rl_initialize();
+  if (interactive)
+    rl_initialize();
 #endif
 
   sigemptyset(&sigchld_mask);
   sigaddset(&sigchld_mask, SIGCHLD);
 
-  if (getsid(0) != getpgid(0))
+  if (interactive && getsid(0) != getpgid(0))
     Setpgid(0, 0);
 
-  initjobs();
+  initjobs(interactive);
+
+  if (interactive) {
+    struct sigaction act = {
+      .sa_handler = sigint_handler,
+      .sa_flags = 0, /* without SA_RESTART read() will return EINTR */
+    };
+    Sigaction(SIGINT, &act, NULL);
 
-  struct sigaction act = {
-    .sa_handler = sigint_handler,
-    .sa_flags = 0, /* without SA_RESTART read() will return EINTR */
-  };
-  Sigaction(SIGINT, &act, NULL);
+    Signal(SIGTSTP, SIG_IGN);
+    Signal(SIGTTIN, SIG_IGN);
+    Signal(SIGTTOU, SIG_IGN);
+  }
 
-  Signal(SIGTSTP, SIG_IGN);
-  Signal(SIGTTIN, SIG_IGN);
-  Signal(SIGTTOU, SIG_IGN);
+  /* Lines are accumulated until they form a complete command. */
+  char *text = NULL;
 
   while (true) {
-    char *line = readline("# ");
+    char *line = interactive ? readline(text ? "> " : "# ") : nextline(&script);
 
     if (line == NULL)
       break;
 
-    if (strlen(line)) {
 #ifdef READLINE
+    if (strlen(line))
       add_history(line);
 #endif
-      eval(line);
-    }
+    strapp(&text, line);
+    strapp(&text, "\n");
     free(line);
+
+    if (eval(text) != P_INCOMPLETE) {
+      free(text);
+      text = NULL;
+    }
     watchjobs(FINISHED);
   }
 
-  msg("\n");
+  if (text) {
+    msg("syntax error: unexpected end of file\n");
+    free(text);
+    exitstatus = 2;
+  }
+  free(input);
+
+  if (interactive)
+    msg("\n");
   shutdownjobs();
 
-  return 0;
+  return exitstatus;
 }
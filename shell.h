@@ -1,7 +1,15 @@
 #ifndef _SHELL_H_
 #define _SHELL_H_
 
+/* Shell uses Linux specific interfaces, but with _GNU_SOURCE glibc declares
+ * its own `gai_error` which clashes with the one from csapp.h. */
+#define _GNU_SOURCE
+#define gai_error glibc_gai_error
+#include <netdb.h>
+#undef gai_error
+
 #include "csapp.h"
+#include <stdatomic.h>
 
 #define msg(...) dprintf(STDERR_FILENO, __VA_ARGS__)
 
@@ -19,15 +27,150 @@ typedef char *token_t;
 #define T_PIPE ((token_t)3)
 #define T_BGJOB ((token_t)4)
 #define T_COLON ((token_t)5)
-#define T_OUTPUT ((token_t)6)
-#define T_INPUT ((token_t)7)
-#define T_APPEND ((token_t)8)
-#define T_BANG ((token_t)9)
-#define separator_p(t) ((t) <= T_COLON)
-#define string_p(t) ((t) > T_BANG)
+#define T_NEWLINE ((token_t)6)
+#define T_OUTPUT ((token_t)7)
+#define T_INPUT ((token_t)8)
+#define T_APPEND ((token_t)9)
+#define T_BANG ((token_t)10)
+#define T_LPAREN ((token_t)11)
+#define T_RPAREN ((token_t)12)
+#define T_HEREDOC ((token_t)13)
+#define T_HERESTR ((token_t)14)
+#define T_RDWR ((token_t)15)
+#define T_DUPIN ((token_t)16)
+#define T_DUPOUT ((token_t)17)
+#define T_IONUMBER ((token_t)18) /* next word is a descriptor number */
+#define T_LAST T_IONUMBER
+#define separator_p(t) ((t) <= T_NEWLINE)
+#define string_p(t) ((t) > T_LAST)
+
+/* Words returned by the lexer have quotes removed. Characters that were
+ * quoted and would be special to expansion are preceded with CTLESC,
+ * double quotes are replaced with CTLQUOTE. Process substitution `<(...)`
+ * or `>(...)` is kept verbatim after CTLPROC. */
+#define CTLESC '\001'
+#define CTLQUOTE '\002'
+#define CTLPROC '\003'
 
 void strapp(char **dstp, const char *src);
-token_t *tokenize(char *s, int *tokc_p);
+token_t *tokenize(const char *text, char *buf, int *tokc_p, bool *incompletep);
+const char *skipcmd(const char *s);
+
+/* Redirection requested by a command. Descriptor `fd` of the command is
+ * connected to a file, made a copy of another descriptor or closed. */
+typedef struct redir {
+  token_t mode; /* redirection operator, e.g. T_OUTPUT or T_DUPOUT */
+  int fd;       /* descriptor of the command being redirected */
+  int flags;    /* flags passed to open if a file is to be opened */
+  char *path;   /* name of file, descriptor number, "-" or text to be read */
+} redir_t;
+
+/* Descriptor of a command and the descriptor of the shell it refers to. */
+typedef struct fdmove {
+  int fd;     /* descriptor as seen by the command */
+  int source; /* descriptor of the shell or -1 if `fd` is to be closed */
+} fdmove_t;
+
+/* Kernel hints for files opened by redirections, see IOHINTS in redir.c. */
+typedef struct iohints {
+  bool sequential; /* file will be accessed sequentially */
+  bool readahead;  /* start reading input file in advance */
+  bool noatime;    /* don't update access time of input file */
+  off_t prealloc;  /* bytes of disk space to reserve for output file */
+} iohints_t;
+
+/* Result of processing redirections of a command, see redir.c. */
+typedef struct fdplan {
+  fdmove_t *moves; /* descriptors that differ from those of the shell */
+  int nmoves;      /* number of moves */
+  int *opened;     /* descriptors opened for the command */
+  int nopened;     /* number of opened descriptors */
+  iohints_t hints; /* hints applied to opened files */
+} fdplan_t;
+
+void mkpipe(int *readp, int *writep, int size);
+int pipesize(token_t *assigns);
+int memfile(const char *name);
+void initplan(fdplan_t *plan, int nredir, int input, int output,
+              char **assigns);
+bool addredir(fdplan_t *plan, redir_t *r, const char *path);
+int planfd(fdplan_t *plan, int fd);
+void applyplan(fdplan_t *plan);
+void keepplan(fdplan_t *plan);
+void freeplan(fdplan_t *plan);
+void sharefd(int fd, bool share);
+
+typedef struct node node_t;
+
+/* Single command of a pipeline with redirection operators stripped.
+ * Compound commands (if, while, etc.) have `node` set instead of `path`. */
+typedef struct stage {
+  token_t *argv;    /* NULL-terminated argument vector */
+  int argc;         /* number of arguments */
+  redir_t *redir;   /* redirections in the order they appeared */
+  int nredir;       /* number of redirections */
+  token_t *assigns; /* NULL-terminated list of assignments before command */
+  bool expand;      /* some of arguments need to be expanded */
+  const char *path; /* cached result of PATH search or NULL */
+  unsigned pathgen; /* `pathgen` at the time of the search */
+  node_t *node;     /* body of compound command or NULL */
+} stage_t;
+
+/* Types of syntax tree nodes. */
+enum {
+  N_PIPELINE, /* one or more stages connected with pipes */
+  N_AND,      /* left && right */
+  N_OR,       /* left || right */
+  N_IF,       /* if left; then right; else orelse; fi */
+  N_WHILE,    /* while left; do right; done */
+  N_UNTIL,    /* until left; do right; done */
+  N_FOR,      /* for var in words; do right; done */
+  N_GROUP,    /* { right; } */
+  N_SUBSHELL, /* ( right ) */
+  N_FUNCDEF,  /* var() stage */
+};
+
+/* Syntax tree of a command. Elements of a command list are linked with
+ * `next`, children are lists as well. */
+struct node {
+  int type;        /* one of N_* constants */
+  node_t *next;    /* next command in a list */
+  bool bg;         /* list element was terminated with '&' */
+  bool negate;     /* pipeline was preceded with '!' */
+  stage_t *stage;  /* stages of N_PIPELINE or body of N_FUNCDEF */
+  int nstages;     /* number of stages */
+  node_t *left;    /* condition or left operand */
+  node_t *right;   /* body or right operand */
+  node_t *orelse;  /* else branch of N_IF */
+  char *var;       /* loop variable of N_FOR or name of N_FUNCDEF */
+  token_t *words;  /* NULL-terminated list of words of N_FOR */
+  struct cmd *cmd; /* command text N_FUNCDEF was parsed from */
+};
+
+/* Parsed command text. All strings point into tokenized copy of the text,
+ * syntax tree is allocated from an arena freed together with the command. */
+typedef struct cmd {
+  char *line;          /* words of the command, see `tokenize` */
+  token_t *token;      /* token vector returned by `tokenize` */
+  node_t *root;        /* list of commands, NULL for empty text */
+  struct arena *arena; /* memory of syntax tree nodes */
+  int refcnt;          /* number of references held to the command */
+} cmd_t;
+
+/* Result of parsing. */
+enum {
+  P_OK = 0,         /* text was parsed successfully */
+  P_ERROR = 1,      /* syntax error was reported */
+  P_INCOMPLETE = 2, /* text ended in the middle of a command */
+};
+
+cmd_t *parse(const char *text, int *statusp);
+cmd_t *holdcmd(cmd_t *cmd);
+void freecmd(cmd_t *cmd);
+cmd_t *getcmd(const char *text, int *statusp);
+void flushcache(void);
+node_t *peephole(node_t *n);
+void freepeephole(node_t *n, node_t *p);
 
 /* Do not change those values or code will break! */
 enum {
@@ -43,21 +186,140 @@ enum {
   STOPPED = 2,  /* jobs that have been suspended by SIGTSTP / SIGSTOP */
 };
 
-void initjobs(void);
+/* Set if job control is enabled, i.e. shell is interactive and
+ * is not running a subshell. */
+extern bool jobctl;
+
+void initjobs(bool interactive);
+void initsubshell(void);
 void shutdownjobs(void);
 
+/* Builtin stage of a pipeline running on a thread of the shell. */
+typedef struct thread {
+  struct thread *next;
+  pid_t pid;        /* negative identifier of the pseudo-process */
+  int status;       /* wait status, valid once `done` is set */
+  atomic_bool done; /* set by the thread when it finishes */
+  bool reaped;      /* set by the main thread once the job is updated */
+} thread_t;
+
 int addjob(pid_t pgid, int bg);
 void addproc(int job, pid_t pid, char **argv);
+thread_t *addthread(void);
+void exitthread(thread_t *t, int status);
 bool killjob(int job);
 void watchjobs(int state);
 char *jobcmd(int job);
 bool resumejob(int job, int bg, sigset_t *mask);
 int monitorjob(sigset_t *mask);
+void waitjob(int job, pid_t pgid, sigset_t *mask);
 
 void setfgpgrp(pid_t pgid);
+void joinpgrp(pid_t pid, pid_t pgid);
+void resetsignals(bool bg);
+void initbarrier(int barrier[2], bool fg);
+void waitbarrier(int barrier[2], pid_t pgid);
+void releasebarrier(int barrier[2]);
+void releasefd(int fd);
+
+/* Standard streams of a builtin command run within shell's process. */
+typedef struct io {
+  int in, out, err;
+} io_t;
+
+/* Builtin command receives its arguments without the command name. */
+typedef int (*builtin_t)(char **argv, io_t *io);
+
+/* Shell function defined with `name() compound-command`. Its body is kept
+ * as a syntax tree, so a call does not parse the text again. */
+typedef struct function {
+  struct function *next; /* next function in the same hash bucket */
+  uint32_t hash;         /* hash of function name */
+  char *name;            /* name of the function */
+  stage_t *body;         /* compound command with its redirections */
+  cmd_t *cmd;            /* parsed command text the body belongs to */
+} function_t;
+
+/* Kinds of commands recognized by `lookup`. */
+enum {
+  C_EXTERNAL = 0, /* program to be found in PATH */
+  C_BUILTIN = 1,  /* builtin command */
+  C_FUNCTION = 2, /* shell function */
+};
+
+/* Flags of builtin commands, see builtins.def. */
+enum {
+  B_PURE = 1,     /* only writes output, doesn't change state of the shell */
+  B_KEEPREDIR = 2, /* redirections are applied to the shell itself */
+};
+
+int lookup(const char *name, builtin_t *builtinp, int *flagsp,
+           function_t **funcp);
+void deffunc(const char *name, stage_t *body, cmd_t *cmd);
+const char *getalias(const char *name);
+char *search_path(const char *name);
+const char *findprogram(const char *name);
+noreturn void external_command(char **argv, const char *path, char **assigns);
+pid_t startcoproc(char **argv, int channel);
+
+/* Exit code of the most recently executed command. */
+extern int exitstatus;
+
+extern char *arg0;       /* name of the shell or script, i.e. $0 */
+extern char **posparams; /* positional parameters, i.e. $1, $2, ... */
+extern pid_t rootpid;    /* process id of the shell, i.e. $$ */
+extern pid_t lastbgpid;  /* last background process, i.e. $! */
+
+/* Shell variables. */
+enum {
+  V_EXPORT = 1, /* variable is passed in environment of commands */
+  V_UNSET = 2,  /* variable was exported before it was set */
+};
+
+typedef struct varsave varsave_t;
+
+extern unsigned pathgen; /* incremented whenever PATH changes */
+
+void initvars(char **envp);
+const char *getvar(const char *name);
+const char *getvarn(const char *name, size_t len);
+void setvar(const char *name, const char *value, int flags);
+void setvars(char **entries, int flags);
+void exportvar(const char *name);
+void unsetvar(const char *name);
+varsave_t *pushvars(char **entries);
+void popvars(varsave_t *saved);
+char **getenvp(char **delta);
+bool varname_p(const char *s, size_t len);
+
+/* Expansion of words. */
+bool needexp_p(const char *word);
+char **expand_words(token_t *words);
+char *expand_word(token_t word);
+char **expand_assigns(token_t *assigns);
+char *cmdsubst(const char *text);
+int procsubst(const char *text, bool output);
+
+/* Pathname expansion. */
+bool pattern_p(const char *s);
+void unescape_pattern(char *s);
+int globpath(const char *pattern, char ***pathsp);
+void flushdirs(void);
+void freewords(char **words);
+
+/* `break` and `continue` make evaluator leave `skipcount` enclosing loops,
+ * `return` leaves the function being called. */
+enum {
+  SKIP_NONE = 0,
+  SKIP_BREAK = 1,
+  SKIP_CONT = 2,
+  SKIP_RETURN = 3,
+};
 
-int builtin_command(char **argv);
-noreturn void external_command(char **argv);
+extern int evalskip;  /* one of SKIP_* constants */
+extern int skipcount; /* number of loops left to skip */
+extern int loopnest;  /* number of loops being evaluated */
+extern int funcnest;  /* number of functions being called */
 
 /* Used by Sigprocmask to enter critical section protecting against SIGCHLD. */
 extern sigset_t sigchld_mask;
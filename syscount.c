@@ -0,0 +1,158 @@
+/* Count system calls made by a shell and by its children before they execute
+ * a program, i.e. the cost of spawning commands. Threads of a process are
+ * accounted like the process itself. Children are left alone once they call
+ * execve successfully.
+ *
+ * Usage: syscount [-o file] command [args...]
+ * Prints "shell NR COUNT" and "child NR COUNT" lines for each system call
+ * number, which are summarized by bench-spawn.py. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAXNR 512 /* upper bound of system call numbers */
+
+enum { UNKNOWN, SHELL, CHILD, NROLES };
+
+static const char *rolename[NROLES] = {"unknown", "shell", "child"};
+static unsigned long counts[NROLES][MAXNR];
+
+typedef struct tracee {
+  pid_t tid;    /* thread being traced */
+  int role;     /* UNKNOWN until its parent reports it */
+  bool stopped; /* initial stop was not consumed yet */
+} tracee_t;
+
+static tracee_t *tracees;
+static int ntracees, maxtracees;
+
+static tracee_t *find(pid_t tid) {
+  for (int i = 0; i < ntracees; i++)
+    if (tracees[i].tid == tid)
+      return &tracees[i];
+  return NULL;
+}
+
+static tracee_t *add(pid_t tid, int role, bool stopped) {
+  if (ntracees == maxtracees) {
+    maxtracees = maxtracees ? maxtracees * 2 : 16;
+    tracees = realloc(tracees, sizeof(tracee_t) * maxtracees);
+  }
+  tracees[ntracees] = (tracee_t){tid, role, stopped};
+  return &tracees[ntracees++];
+}
+
+static void delete(pid_t tid) {
+  tracee_t *t = find(tid);
+  if (t)
+    *t = tracees[--ntracees];
+}
+
+static void resume(pid_t tid, int sig) {
+  if (ptrace(PTRACE_SYSCALL, tid, 0, sig) < 0 && errno != ESRCH)
+    perror("ptrace");
+}
+
+/* New thread or process reported by `parent`. It may have stopped already,
+ * in which case it waits to learn its role. */
+static void spawned(tracee_t *parent, int event) {
+  unsigned long tid;
+  ptrace(PTRACE_GETEVENTMSG, parent->tid, 0, &tid);
+  int role = event == PTRACE_EVENT_CLONE ? parent->role : CHILD;
+  tracee_t *t = find(tid);
+  if (t == NULL) {
+    add(tid, role, true);
+  } else {
+    t->role = role;
+    t->stopped = false;
+    resume(tid, 0);
+  }
+}
+
+static noreturn void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-o file] command [args...]\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  FILE *out = stdout;
+  int opt;
+  while ((opt = getopt(argc, argv, "+o:")) != -1)
+    if (opt != 'o' || (out = fopen(optarg, "w")) == NULL)
+      usage(argv[0]);
+  if (optind == argc)
+    usage(argv[0]);
+  argv += optind;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    ptrace(PTRACE_TRACEME, 0, 0, 0);
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(EXIT_FAILURE);
+  }
+
+  int status;
+  waitpid(pid, &status, 0); /* stopped at execve */
+  ptrace(PTRACE_SETOPTIONS, pid, 0,
+         PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+           PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL);
+  add(pid, SHELL, false);
+  resume(pid, 0);
+
+  int exitcode = EXIT_FAILURE;
+  pid_t tid;
+  while ((tid = waitpid(-1, &status, __WALL)) > 0) {
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (tid == pid)
+        exitcode = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+      delete(tid);
+      continue;
+    }
+
+    int sig = WSTOPSIG(status), event = status >> 16;
+    tracee_t *t = find(tid);
+
+    if (t == NULL) {
+      /* Stopped before its parent reported it. */
+      add(tid, UNKNOWN, true);
+      continue;
+    }
+
+    if (sig == (SIGTRAP | 0x80)) {
+      struct __ptrace_syscall_info info;
+      ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info);
+      if (info.op == PTRACE_SYSCALL_INFO_ENTRY && info.entry.nr < MAXNR)
+        counts[t->role][info.entry.nr]++;
+      sig = 0;
+    } else if (sig == SIGTRAP && event) {
+      if (event == PTRACE_EVENT_EXEC && t->role == CHILD) {
+        ptrace(PTRACE_DETACH, tid, 0, 0);
+        delete(tid);
+        continue;
+      }
+      if (event != PTRACE_EVENT_EXEC)
+        spawned(t, event);
+      sig = 0;
+    } else if (sig == SIGSTOP && t->stopped) {
+      t->stopped = false;
+      sig = 0;
+    }
+    resume(tid, sig);
+  }
+
+  for (int role = SHELL; role < NROLES; role++)
+    for (int nr = 0; nr < MAXNR; nr++)
+      if (counts[role][nr])
+        fprintf(out, "%s %d %lu\n", rolename[role], nr, counts[role][nr]);
+  fclose(out);
+  return exitcode;
+}
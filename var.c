@@ -0,0 +1,239 @@
+#include "shell.h"
+
+/* Shell variables are kept in a hash table. Each variable stores its
+ * "name=value" string, so the environment passed to execve is a vector of
+ * pointers to those strings. The vector is shared by all commands started
+ * by the shell and it's rebuilt only after an exported variable changed.
+ * Assignments preceding a command are layered on top of it. */
+
+#define NBUCKETS 256 /* must be a power of two */
+
+typedef struct var {
+  struct var *next; /* next variable in the same bucket */
+  uint32_t hash;    /* hash of variable name */
+  size_t namelen;   /* length of the name */
+  char *entry;      /* "name=value" string */
+  int flags;        /* V_* flags */
+} var_t;
+
+/* Previous state of a variable overridden by `pushvars`. */
+struct varsave {
+  char *name;  /* name of the variable, NULL terminates the array */
+  char *entry; /* previous "name=value" string or NULL if it was not set */
+  int flags;   /* previous flags */
+};
+
+static var_t *vars[NBUCKETS];
+static int nexported = 0;  /* number of variables marked for export */
+static char **envp = NULL; /* environment built from exported variables */
+static bool envdirty;      /* envp must be rebuilt before use */
+unsigned pathgen;
+
+static bool path_p(var_t *v) {
+  return v->namelen == 4 && !strncmp(v->entry, "PATH", 4);
+}
+
+static var_t **findvar(const char *name, size_t len, uint32_t hash) {
+  var_t **vp = &vars[hash & (NBUCKETS - 1)];
+  for (; *vp; vp = &(*vp)->next) {
+    var_t *v = *vp;
+    if (v->hash == hash && v->namelen == len && !strncmp(v->entry, name, len))
+      break;
+  }
+  return vp;
+}
+
+/* Returns value of variable named by first `len` characters of `name`
+ * or NULL if it's not set. */
+const char *getvarn(const char *name, size_t len) {
+  var_t *v = *findvar(name, len, jenkins_hash(name, len, HASHINIT));
+  return v && !(v->flags & V_UNSET) ? v->entry + len + 1 : NULL;
+}
+
+const char *getvar(const char *name) {
+  return getvarn(name, strlen(name));
+}
+
+/* Returns variable named by first `len` characters of `name`, creates it
+ * if it does not exist. */
+static var_t *getvarp(const char *name, size_t len) {
+  uint32_t hash = jenkins_hash(name, len, HASHINIT);
+  var_t **vp = findvar(name, len, hash);
+  var_t *v = *vp;
+
+  if (v == NULL) {
+    v = calloc(1, sizeof(var_t));
+    v->hash = hash;
+    v->namelen = len;
+    v->flags = V_UNSET;
+    v->entry = strndup(name, len);
+    *vp = v;
+  }
+  return v;
+}
+
+/* Replace "name=value" string of a variable, `entry` is owned by it. */
+static void putentry(var_t *v, char *entry, int flags) {
+  if ((v->flags & V_EXPORT) != (flags & V_EXPORT))
+    nexported += (flags & V_EXPORT) ? 1 : -1;
+  if ((v->flags | flags) & V_EXPORT)
+    envdirty = true;
+  if (path_p(v))
+    pathgen++;
+  free(v->entry);
+  v->entry = entry;
+  v->flags = flags;
+}
+
+/* Set variable to a value. Flags are added to flags of existing variable. */
+void setvar(const char *name, const char *value, int flags) {
+  size_t len = strlen(name);
+  var_t *v = getvarp(name, len);
+  char *entry = malloc(len + strlen(value) + 2);
+  stpcpy(stpcpy(stpcpy(entry, name), "="), value);
+  putentry(v, entry, (v->flags | flags) & ~V_UNSET);
+}
+
+/* Set variables from "name=value" strings. */
+void setvars(char **entries, int flags) {
+  for (; *entries; entries++) {
+    char *eq = strchr(*entries, '=');
+    var_t *v = getvarp(*entries, eq - *entries);
+    putentry(v, strdup(*entries), (v->flags | flags) & ~V_UNSET);
+  }
+}
+
+/* Mark variable as exported. It's passed to commands once it's set. */
+void exportvar(const char *name) {
+  var_t *v = getvarp(name, strlen(name));
+  putentry(v, strdup(v->entry), v->flags | V_EXPORT);
+}
+
+/* Remove variable along with its flags. */
+void unsetvar(const char *name) {
+  size_t len = strlen(name);
+  var_t **vp = findvar(name, len, jenkins_hash(name, len, HASHINIT));
+  var_t *v = *vp;
+  if (v == NULL)
+    return;
+  if (v->flags & V_EXPORT) {
+    nexported--;
+    envdirty = true;
+  }
+  if (path_p(v))
+    pathgen++;
+  *vp = v->next;
+  free(v->entry);
+  free(v);
+}
+
+/* Set variables from "name=value" strings for the duration of a builtin or
+ * function call. Returns their previous state to be passed to `popvars`. */
+varsave_t *pushvars(char **entries) {
+  int n = 0;
+  while (entries[n])
+    n++;
+
+  varsave_t *saved = malloc(sizeof(varsave_t) * (n + 1));
+  for (int i = 0; i < n; i++) {
+    char *eq = strchr(entries[i], '=');
+    var_t *v = getvarp(entries[i], eq - entries[i]);
+    saved[i].name = strndup(entries[i], eq - entries[i]);
+    saved[i].entry = v->flags & V_UNSET ? NULL : strdup(v->entry);
+    saved[i].flags = v->flags;
+    putentry(v, strdup(entries[i]), (v->flags | V_EXPORT) & ~V_UNSET);
+  }
+  saved[n].name = NULL;
+  return saved;
+}
+
+/* Restore variables overridden by `pushvars` in reverse order. */
+void popvars(varsave_t *saved) {
+  int n = 0;
+  while (saved[n].name)
+    n++;
+
+  while (--n >= 0) {
+    varsave_t *s = &saved[n];
+    if (s->entry == NULL && !(s->flags & V_EXPORT)) {
+      unsetvar(s->name);
+    } else {
+      var_t *v = getvarp(s->name, strlen(s->name));
+      putentry(v, s->entry ? s->entry : strdup(s->name), s->flags);
+    }
+    free(s->name);
+  }
+  free(saved);
+}
+
+/* Returns true if "name=value" strings `a` and `b` have the same name. */
+static bool samename(const char *a, const char *b) {
+  size_t len = strcspn(a, "=");
+  return !strncmp(a, b, len + 1);
+}
+
+/* Returns environment for a program to be executed. Assignments in `delta`
+ * replace or extend exported variables in a new vector, that shares
+ * strings with the cached one. */
+char **getenvp(char **delta) {
+  if (envdirty) {
+    envp = realloc(envp, sizeof(char *) * (nexported + 1));
+    int n = 0;
+    for (int i = 0; i < NBUCKETS; i++)
+      for (var_t *v = vars[i]; v; v = v->next)
+        if ((v->flags & (V_EXPORT | V_UNSET)) == V_EXPORT)
+          envp[n++] = v->entry;
+    envp[n] = NULL;
+    envdirty = false;
+  }
+
+  if (delta == NULL || delta[0] == NULL)
+    return envp;
+
+  int ndelta = 0;
+  while (delta[ndelta])
+    ndelta++;
+
+  char **layered = malloc(sizeof(char *) * (nexported + ndelta + 1));
+  int n = 0;
+  for (char **ep = envp; *ep; ep++) {
+    bool replaced = false;
+    for (int i = 0; i < ndelta && !replaced; i++)
+      replaced = samename(*ep, delta[i]);
+    if (!replaced)
+      layered[n++] = *ep;
+  }
+  /* The last of repeated assignments wins. */
+  for (int i = 0; i < ndelta; i++) {
+    bool repeated = false;
+    for (int j = i + 1; j < ndelta && !repeated; j++)
+      repeated = samename(delta[i], delta[j]);
+    if (!repeated)
+      layered[n++] = delta[i];
+  }
+  layered[n] = NULL;
+  return layered;
+}
+
+/* Import environment of the shell as exported variables. */
+void initvars(char **environ) {
+  for (char **ep = environ; *ep; ep++) {
+    char *eq = strchr(*ep, '=');
+    if (eq == NULL)
+      continue;
+    char *name = strndup(*ep, eq - *ep);
+    setvar(name, eq + 1, V_EXPORT);
+    free(name);
+  }
+  getenvp(NULL);
+}
+
+/* Returns true if `len` first characters of `s` form a variable name. */
+bool varname_p(const char *s, size_t len) {
+  if (len == 0 || !(isalpha(s[0]) || s[0] == '_'))
+    return false;
+  for (size_t i = 1; i < len; i++)
+    if (!(isalnum(s[i]) || s[i] == '_'))
+      return false;
+  return true;
+}